@@ -41,6 +41,16 @@ static dev_t scull_a_firstdev;  /* Where our range begins */
  * These devices fall back on the main scull operations. They only
  * differ in the implementation of open() and close()
  */
+
+/*
+ * Trimming on a write-only open, as scull_open does: with the
+ * semaphore held for writing, as other openers may be at I/O.
+ */
+static void scull_a_trim(struct scull_dev *dev) {
+   down_write(&dev->sem);
+   scull_trim(dev); /* ignore errors */
+   up_write(&dev->sem);
+}
  
  
 /************************************************************************
@@ -61,7 +71,7 @@ static int scull_s_open(struct inode *inode, struct file *filp) {
    }
  
    /* then, everything else is copied from the bare scull device */
-   if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) scull_trim(dev);
+   if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) scull_a_trim(dev);
    filp->private_data = dev;
    return 0;          /* success */
 }
@@ -80,7 +90,12 @@ struct file_operations scull_sngl_fops = {
    .llseek =       scull_llseek,
    .read =         scull_read,
    .write =        scull_write,
+   .aio_read =     scull_aio_read,
+   .aio_write =    scull_aio_write,
+   .splice_read =  scull_splice_read,
+   .splice_write = scull_splice_write,
    .unlocked_ioctl = scull_ioctl,
+   .mmap =         scull_mmap,
    .open =         scull_s_open,
    .release =      scull_s_release,
 };
@@ -115,7 +130,7 @@ static int scull_u_open(struct inode *inode, struct file *filp) {
    spin_unlock(&scull_u_lock);
  
    /* then, everything else is copied from the bare scull device */
-   if ((filp->f_flags & O_ACCMODE) == O_WRONLY) scull_trim(dev);
+   if ((filp->f_flags & O_ACCMODE) == O_WRONLY) scull_a_trim(dev);
    filp->private_data = dev;
    return 0;          /* success */
 }
@@ -135,7 +150,12 @@ struct file_operations scull_user_fops = {
    .llseek =     scull_llseek,
    .read =       scull_read,
    .write =      scull_write,
+   .aio_read =   scull_aio_read,
+   .aio_write =  scull_aio_write,
+   .splice_read = scull_splice_read,
+   .splice_write = scull_splice_write,
    .unlocked_ioctl =      scull_ioctl,
+   .mmap =       scull_mmap,
    .open =       scull_u_open,
    .release =    scull_u_release,
 };
@@ -175,7 +195,7 @@ static int scull_w_open(struct inode *inode, struct file *filp) {
    
    /* then, everything else is copied from the bare scull device */
    if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
-      scull_trim(dev);
+      scull_a_trim(dev);
    filp->private_data = dev;
    return 0;          /* success */
 }
@@ -201,7 +221,12 @@ struct file_operations scull_wusr_fops = {
    .llseek =     scull_llseek,
    .read =       scull_read,
    .write =      scull_write,
+   .aio_read =   scull_aio_read,
+   .aio_write =  scull_aio_write,
+   .splice_read = scull_splice_read,
+   .splice_write = scull_splice_write,
    .unlocked_ioctl = scull_ioctl,
+   .mmap =       scull_mmap,
    .open =       scull_w_open,
    .release =    scull_w_release,
 };
@@ -243,8 +268,7 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key) {
    /* initialize the device */
    memset(lptr, 0, sizeof(struct scull_listitem));
    lptr->key = key;
-   scull_trim(&(lptr->device)); /* initialize it */
-   sema_init(&(lptr->device.sem), 1);
+   scull_init_dev(&(lptr->device)); /* initialize it */
    
    /* place it in the list */
    list_add(&lptr->list, &scull_c_list);
@@ -270,7 +294,7 @@ static int scull_c_open(struct inode *inode, struct file *filp) {
    if (!dev) return -ENOMEM;
 
    /* then, everything else is copied from the bare scull device */
-   if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) scull_trim(dev);
+   if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) scull_a_trim(dev);
    filp->private_data = dev;
    return 0;          /* success */
 }
@@ -291,7 +315,12 @@ struct file_operations scull_priv_fops = {
    .llseek =   scull_llseek,
    .read =     scull_read,
    .write =    scull_write,
+   .aio_read = scull_aio_read,
+   .aio_write = scull_aio_write,
+   .splice_read = scull_splice_read,
+   .splice_write = scull_splice_write,
    .unlocked_ioctl = scull_ioctl,
+   .mmap =     scull_mmap,
    .open =     scull_c_open,
    .release =  scull_c_release,
 };
@@ -322,9 +351,7 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo) {
    int err;
  
    /* Initialize the device structure */
-   dev->quantum = scull_quantum;
-   dev->qset = scull_qset;
-   sema_init(&dev->sem, 1);
+   scull_init_dev(dev);
    
    /* Do the cdev stuff. */
    cdev_init(&dev->cdev, devinfo->fops);
@@ -375,9 +402,11 @@ void scull_access_cleanup(void) {
    }
  
    /* And all the cloned devices */
+   list_for_each_entry(lptr, &scull_c_list, list)
+      scull_trim(&(lptr->device));
+   scull_flush_work(); /* before the devices go away */
    list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
       list_del(&lptr->list);
-      scull_trim(&(lptr->device));
       kfree(lptr);
    }
    
@@ -0,0 +1,357 @@
+/*
+ * compress.c -- compression of cold quanta
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>       /* printk() */
+#include <linux/slab.h>         /* kmalloc() */
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/errno.h>        /* error codes */
+#include <linux/cdev.h>
+#include <linux/crypto.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/radix-tree.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/err.h>
+#include <asm/atomic.h>
+#include <asm/uaccess.h>        /* copy_to_user */
+
+#include "scull.h"              /* local definitions */
+
+/*
+ * Quanta of the bare devices that nobody wrote for scull_cold seconds
+ * are compressed with the scull_compress algorithm of the crypto API
+ * ("lz4", "lzo", ...), if one was given at load time. A compressed
+ * quantum stays in its slot, tagged (see SCULL_ZQUANTUM): readers
+ * decompress a copy, writers (and mmap) get the quantum back for good.
+ */
+static char *scull_compress = NULL;
+static int scull_cold = 60;
+module_param(scull_compress, charp, S_IRUGO);
+module_param(scull_cold, int, S_IRUGO);
+
+struct scull_zquantum {
+   unsigned int len;         /* compressed size */
+   unsigned int orig;        /* the size of the quantum */
+   char data[0];
+};
+
+/*
+ * Decompression happens in any reader, so each CPU has a transform of
+ * its own. It is taken with a mutex, not by turning preemption off: a
+ * huge quantum takes a while to decompress, and a reader that moved
+ * to another CPU meanwhile just waits its turn. Compression only
+ * happens in the scan, which has its own, and its own workqueue, as
+ * it may keep a CPU busy for long.
+ */
+struct scull_ztfm_cpu {
+   struct crypto_comp *tfm;
+   struct mutex lock;
+};
+
+static struct scull_ztfm_cpu __percpu *scull_ztfms;
+static struct crypto_comp *scull_ztfm;
+static struct workqueue_struct *scull_zwq;
+
+static atomic_long_t scull_zquanta;     /* compressed quanta */
+static atomic_long_t scull_zorig;       /* the bytes they stand for */
+static atomic_long_t scull_zbytes;      /* the bytes they take */
+
+static void scull_zscan_all(struct work_struct *work);
+static DECLARE_DELAYED_WORK(scull_zwork, scull_zscan_all);
+
+static struct scull_zquantum *scull_zuntag(void *zq) {
+   return (struct scull_zquantum *)((unsigned long) zq & ~SCULL_ZTAG);
+}
+
+void scull_zfree(void *zq) {
+   struct scull_zquantum *z = scull_zuntag(zq);
+
+   atomic_long_dec(&scull_zquanta);
+   atomic_long_sub(z->orig, &scull_zorig);
+   atomic_long_sub(z->len, &scull_zbytes);
+   kfree(z);
+}
+
+/*
+ * Decompress a tagged quantum into dst, which has room for all of it.
+ */
+int scull_zunpack(void *zq, void *dst, int quantum) {
+   struct scull_zquantum *z = scull_zuntag(zq);
+   struct scull_ztfm_cpu *zc;
+   unsigned int dlen = quantum;
+   int err;
+
+   if (!scull_ztfms)
+      return -EIO; /* can't be: nothing was compressed */
+   zc = per_cpu_ptr(scull_ztfms, raw_smp_processor_id()); /* any will do */
+   mutex_lock(&zc->lock);
+   err = crypto_comp_decompress(zc->tfm, z->data, z->len, dst, &dlen);
+   mutex_unlock(&zc->lock);
+   if (err || dlen != quantum)
+      return -EIO;
+   return 0;
+}
+
+static void scull_zput(char *q, int quantum) {
+   if (quantum > PAGE_SIZE)
+      vfree(q);
+   else
+      kfree(q);
+}
+
+/*
+ * A lockless reader can't decompress a quantum in place: it gets a
+ * copy of its own, freed with scull_zput.
+ */
+static char *scull_zget(void *zq, int quantum) {
+   char *q;
+
+   if (quantum > PAGE_SIZE)
+      q = vmalloc(quantum);
+   else
+      q = kmalloc(quantum, GFP_KERNEL);
+   if (!q)
+      return ERR_PTR(-ENOMEM);
+   if (scull_zunpack(zq, q, quantum)) {
+      scull_zput(q, quantum);
+      return ERR_PTR(-EIO);
+   }
+   return q;
+}
+
+/*
+ * Copy part of a compressed quantum to user space.
+ */
+int scull_zread(char __user *buf, void *zq, int q_pos, size_t count,
+		int quantum) {
+   char *q = scull_zget(zq, quantum);
+   int retval = 0;
+
+   if (IS_ERR(q))
+      return PTR_ERR(q);
+   if (copy_to_user(buf, q + q_pos, count))
+      retval = -EFAULT;
+   scull_zput(q, quantum);
+   return retval;
+}
+
+/*
+ * The same, to kernel space (for splice).
+ */
+int scull_zcopy(void *dst, void *zq, int q_pos, size_t count, int quantum) {
+   char *q = scull_zget(zq, quantum);
+
+   if (IS_ERR(q))
+      return PTR_ERR(q);
+   memcpy(dst, q + q_pos, count);
+   scull_zput(q, quantum);
+   return 0;
+}
+
+/*
+ * Compress one quantum into scratch, and swap the result in if it
+ * saves at least a quarter. Called with the item mutex held, which a
+ * fault takes too: what scull_zscan saw before taking it is checked
+ * again, as the device may have been mapped and the item faulted in
+ * meanwhile. Compressing a mapped page would lose the stores made
+ * through it.
+ */
+static void scull_zpack(struct scull_dev *dev, struct scull_qset *dptr,
+			int s_pos, int quantum, char *scratch) {
+   void *q = dptr->data[s_pos], *uq;
+   struct scull_zquantum *z;
+   unsigned int dlen = 2 * quantum;
+
+   if (atomic_read(&dev->vmas) ||
+       time_before(jiffies, dptr->stamp + scull_cold * HZ))
+      return;
+   if (q && SCULL_SQUANTUM(q) && (uq = scull_sunwrap(q))) {
+      rcu_assign_pointer(dptr->data[s_pos], uq); /* not shared any more */
+      q = uq;
+   }
+   if (!q || SCULL_ZQUANTUM(q) || SCULL_SQUANTUM(q)) /* not shared ones */
+      return;
+   if (crypto_comp_compress(scull_ztfm, q, quantum, scratch, &dlen) ||
+       dlen > quantum - quantum / 4)
+      return;
+   z = kmalloc(sizeof(*z) + dlen, GFP_KERNEL | __GFP_NOWARN);
+   if (!z)
+      return;
+   z->len = dlen;
+   z->orig = quantum;
+   memcpy(z->data, scratch, dlen);
+   atomic_long_inc(&scull_zquanta);
+   atomic_long_add(quantum, &scull_zorig);
+   atomic_long_add(dlen, &scull_zbytes);
+
+   rcu_assign_pointer(dptr->data[s_pos],
+		      (void *)((unsigned long) z | SCULL_ZTAG));
+   scull_retire_quantum(q, quantum);
+}
+
+/*
+ * Compress the cold items of one device. Holding the semaphore keeps
+ * trim and relayout away; mapped devices are left alone, as the
+ * pages of their quanta may be in user space.
+ */
+static void scull_zscan(struct scull_dev *dev) {
+   struct scull_qset *dptr;
+   unsigned long item = 0;
+   int quantum, qset, s_pos, found;
+   char *scratch;
+
+   down_read(&dev->sem);
+   if (atomic_read(&dev->vmas))
+      goto out;
+   quantum = dev->quantum;
+   qset = dev->qset;
+   scratch = vmalloc(2 * quantum); /* room for what does not compress */
+   if (!scratch)
+      goto out;
+
+   for (;;) {
+      rcu_read_lock();
+      found = radix_tree_gang_lookup(&dev->index, (void **) &dptr,
+				     item, 1);
+      rcu_read_unlock();
+      if (!found)
+	 break;
+      item = dptr->item + 1;
+      if (time_before(jiffies, dptr->stamp + scull_cold * HZ))
+	 continue;
+
+      mutex_lock(&dptr->mutex);
+      /* an array still shared with a snapshot is left as it is */
+      if (scull_sarray_reclaim(dptr))
+	 for (s_pos = 0; dptr->data && s_pos < qset; s_pos++)
+	    scull_zpack(dev, dptr, s_pos, quantum, scratch);
+      mutex_unlock(&dptr->mutex);
+      cond_resched();
+   }
+   vfree(scratch);
+ out:
+   up_read(&dev->sem);
+}
+
+static void scull_zscan_all(struct work_struct *work) {
+   int i;
+
+   for (i = 0; i < scull_nr_devs; i++)
+      scull_zscan(scull_devices + i);
+   queue_delayed_work(scull_zwq, &scull_zwork, scull_cold * HZ);
+}
+
+/*
+ * The debugfs file: how much the compressed quanta save.
+ */
+static int scull_zstats_show(struct seq_file *s, void *v) {
+   unsigned long orig = atomic_long_read(&scull_zorig);
+   unsigned long bytes = atomic_long_read(&scull_zbytes);
+   unsigned long ratio = bytes ? orig * 100 / bytes : 0;
+
+   seq_printf(s, "algorithm: %s\n", scull_ztfm ? scull_compress : "none");
+   seq_printf(s, "quanta:    %li\n", atomic_long_read(&scull_zquanta));
+   seq_printf(s, "orig:      %lu\n", orig);
+   seq_printf(s, "stored:    %lu\n", bytes);
+   seq_printf(s, "ratio:     %lu.%02lu\n", ratio / 100, ratio % 100);
+   return 0;
+}
+
+static int scull_zstats_open(struct inode *inode, struct file *file) {
+   return single_open(file, scull_zstats_show, NULL);
+}
+
+static struct file_operations scull_zstats_fops = {
+   .owner =   THIS_MODULE,
+   .open =    scull_zstats_open,
+   .read =    seq_read,
+   .llseek =  seq_lseek,
+   .release = single_release,
+};
+
+static void scull_zfree_tfms(void) {
+   int cpu;
+
+   if (scull_ztfms) {
+      for_each_possible_cpu(cpu)
+	 if (per_cpu_ptr(scull_ztfms, cpu)->tfm)
+	    crypto_free_comp(per_cpu_ptr(scull_ztfms, cpu)->tfm);
+      free_percpu(scull_ztfms);
+      scull_ztfms = NULL;
+   }
+   if (scull_ztfm)
+      crypto_free_comp(scull_ztfm);
+   scull_ztfm = NULL;
+   if (scull_zwq)
+      destroy_workqueue(scull_zwq);
+   scull_zwq = NULL;
+}
+
+/*
+ * Called once the devices exist. Failing to set compression up is
+ * not fatal: the devices just keep their quanta as they are.
+ */
+void scull_compress_init(void) {
+   struct crypto_comp *tfm;
+   int cpu;
+
+   debugfs_create_file("compression", S_IRUGO, scull_debugfs, NULL,
+		       &scull_zstats_fops);
+   if (!scull_compress || !*scull_compress || scull_cold <= 0)
+      return;
+
+   scull_ztfms = alloc_percpu(struct scull_ztfm_cpu);
+   if (!scull_ztfms)
+      goto fail;
+   for_each_possible_cpu(cpu) {
+      mutex_init(&per_cpu_ptr(scull_ztfms, cpu)->lock);
+      tfm = crypto_alloc_comp(scull_compress, 0, 0);
+      if (IS_ERR(tfm))
+	 goto fail;
+      per_cpu_ptr(scull_ztfms, cpu)->tfm = tfm;
+   }
+   tfm = crypto_alloc_comp(scull_compress, 0, 0);
+   if (IS_ERR(tfm))
+      goto fail;
+   scull_ztfm = tfm;
+   scull_zwq = alloc_workqueue("scull_cold", WQ_UNBOUND, 1);
+   if (!scull_zwq)
+      goto fail;
+   queue_delayed_work(scull_zwq, &scull_zwork, scull_cold * HZ);
+   return;
+
+ fail:
+   printk(KERN_WARNING "scull: can't use \"%s\", not compressing\n",
+	  scull_compress);
+   scull_zfree_tfms();
+}
+
+/*
+ * Stop the scan. Compressed quanta left in the devices are freed with
+ * the rest of them; they need no transform for that.
+ */
+void scull_compress_cleanup(void) {
+   cancel_delayed_work_sync(&scull_zwork);
+   scull_zfree_tfms();
+}
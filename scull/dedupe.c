@@ -0,0 +1,175 @@
+/*
+ * dedupe.c -- sharing of identical quanta
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>       /* printk() */
+#include <linux/slab.h>         /* kmalloc() */
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/radix-tree.h>
+#include <linux/srcu.h>
+#include <asm/atomic.h>
+
+#include "scull.h"              /* local definitions */
+
+/*
+ * With scull_dedupe set, every quantum that a write fills entirely is
+ * hashed and looked up among the quanta already shared: if the same
+ * contents are there, the slot points to that copy instead, tagged
+ * (see SCULL_SQUANTUM), and the new quantum goes away. Otherwise the
+ * quantum itself becomes shareable. Readers don't care; writers copy
+ * a shared quantum before changing it (see scull_quantum_at).
+ *
+ * The quanta of an array shared with a snapshot are shared the same
+ * way once a write gives the item an array of its own (scull_unshare),
+ * without looking at what is in them: those never enter the hash
+ * table.
+ */
+static int scull_dedupe = 0;
+module_param(scull_dedupe, int, S_IRUGO);
+
+struct scull_shared {
+   struct hlist_node node;
+   u32 hash;
+   int quantum;
+   int refs;                 /* slots pointing here, under the lock */
+   void *q;
+   struct rcu_head rcu;      /* see scull_sunwrap */
+};
+
+static DEFINE_HASHTABLE(scull_shared_hash, 10);
+static DEFINE_SPINLOCK(scull_shared_lock);
+
+static struct scull_shared *scull_suntag(void *sq) {
+   return (struct scull_shared *)((unsigned long) sq & ~SCULL_STAG);
+}
+
+void *scull_sdata(void *sq) {
+   return scull_suntag(sq)->q;
+}
+
+/*
+ * Share a quantum that was just written. Returns the tagged pointer
+ * to store in its slot, NULL if it can't be shared. If the result
+ * points to other data (scull_sdata tells), q is no longer needed.
+ */
+void *scull_share(void *q, int quantum) {
+   struct scull_shared *s, *new;
+   u32 hash;
+
+   if (!scull_dedupe)
+      return NULL;
+   new = kmalloc(sizeof(*new), GFP_KERNEL);
+   if (!new)
+      return NULL;
+   hash = jhash(q, quantum, quantum);
+
+   spin_lock(&scull_shared_lock);
+   hash_for_each_possible(scull_shared_hash, s, node, hash) {
+      if (s->hash == hash && s->quantum == quantum &&
+	  !memcmp(s->q, q, quantum)) {
+	 s->refs++;
+	 spin_unlock(&scull_shared_lock);
+	 kfree(new);
+	 return (void *)((unsigned long) s | SCULL_STAG);
+      }
+   }
+   new->hash = hash;
+   new->quantum = quantum;
+   new->refs = 1;
+   new->q = q;
+   hash_add(scull_shared_hash, &new->node, hash);
+   spin_unlock(&scull_shared_lock);
+   return (void *)((unsigned long) new | SCULL_STAG);
+}
+
+/*
+ * Make a quantum shareable as it is, with one reference (for the slot
+ * it is in). The quantum may be compressed. NULL if out of memory.
+ */
+void *scull_swrap(void *q, int quantum) {
+   struct scull_shared *s = kmalloc(sizeof(*s), GFP_KERNEL);
+
+   if (!s)
+      return NULL;
+   INIT_HLIST_NODE(&s->node);
+   s->hash = 0;
+   s->quantum = quantum;
+   s->refs = 1;
+   s->q = q;
+   return (void *)((unsigned long) s | SCULL_STAG);
+}
+
+/*
+ * One more slot points to a shared quantum.
+ */
+void *scull_sget(void *sq) {
+   spin_lock(&scull_shared_lock);
+   scull_suntag(sq)->refs++;
+   spin_unlock(&scull_shared_lock);
+   return sq;
+}
+
+static void scull_sfree(struct rcu_head *head) {
+   kfree(container_of(head, struct scull_shared, rcu));
+}
+
+/*
+ * If the slot holding sq is the only one left (a snapshot was dropped,
+ * say), return the quantum itself for the slot to hold instead, and
+ * the wrapper goes away once readers are done with it. NULL if it is
+ * still shared. Called with the item mutex held: no other slot can
+ * come to share it meanwhile but through the hash table, and it
+ * leaves that first.
+ */
+void *scull_sunwrap(void *sq) {
+   struct scull_shared *s = scull_suntag(sq);
+   void *q = s->q;
+
+   spin_lock(&scull_shared_lock);
+   if (s->refs != 1) {
+      spin_unlock(&scull_shared_lock);
+      return NULL;
+   }
+   hash_del(&s->node); /* if it was ever hashed */
+   spin_unlock(&scull_shared_lock);
+   call_srcu(&scull_srcu, &s->rcu, scull_sfree);
+   return q;
+}
+
+/*
+ * A slot lets go of a shared quantum; the last one frees it. Like any
+ * quantum, it's only called once no reader can see the slot's value.
+ */
+void scull_sput(void *sq) {
+   struct scull_shared *s = scull_suntag(sq);
+
+   spin_lock(&scull_shared_lock);
+   if (--s->refs) {
+      spin_unlock(&scull_shared_lock);
+      return;
+   }
+   hash_del(&s->node); /* if it was ever hashed */
+   spin_unlock(&scull_shared_lock);
+   scull_free_quantum(s->q, s->quantum);
+   kfree(s);
+}
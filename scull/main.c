@@ -20,6 +20,11 @@
  
 #include <linux/kernel.h>       /* printk() */
 #include <linux/slab.h>         /* kmalloc() */
+#include <linux/string.h>       /* memchr_inv() */
+#include <linux/mm.h>           /* alloc_pages_exact() */
+#include <linux/nodemask.h>     /* node_online() */
+#include <linux/sched.h>        /* fatal_signal_pending() */
+#include <linux/log2.h>         /* roundup_pow_of_two() */
 #include <linux/fs.h>           /* everything... */
 #include <linux/errno.h>        /* error codes */
 #include <linux/types.h>        /* size_t */
@@ -27,12 +32,36 @@
 #include <linux/fcntl.h>        /* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
-#include <linux/semaphore.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/jiffies.h>
+#include <linux/err.h>
+#include <linux/radix-tree.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
+#include <linux/aio.h>          /* struct kiocb */
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/highmem.h>        /* kmap() */
+#include <linux/pagemap.h>      /* fault_in_pages_readable() */
+#include <linux/uaccess.h>      /* pagefault_disable() */
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
  
 #include <asm/uaccess.h>        /* copy_*_user */
  
 #include "scull.h"              /* local definitions */
  
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+ 
 /*
  * Parameters which can be set at load time.
  */
@@ -41,41 +70,493 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;      /* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+unsigned long scull_limit = 0;  /* bytes of quanta per device, 0: none */
+int scull_huge = 0;             /* use huge quanta by default */
+int scull_node = SCULL_NODE_LOCAL;      /* where the memory goes */
  
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_limit, ulong, S_IRUGO);
+module_param(scull_huge, int, S_IRUGO);
+module_param(scull_node, int, S_IRUGO);
  
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scull_dev *scull_devices;        /* allocated in scull_init_module */
+struct dentry *scull_debugfs;           /* our debugfs directory */
+
+/*
+ * Readers of the bare devices take no lock at all, only this (per-cpu)
+ * SRCU read lock: items, arrays and quanta are only freed after a
+ * grace period. It is SRCU rather than plain RCU because a reader
+ * may sleep in copy_to_user.
+ */
+struct srcu_struct scull_srcu;
  
+/*
+ * Storage for the quanta, the quantum-set arrays and the items that
+ * hold them. Each gets a cache of its own, sized for the geometry
+ * given at load time, and a small mempool on top: a writer the
+ * allocator turns down takes what the pool keeps in reserve, if
+ * anything, but never waits for it to be refilled -- the memory
+ * that would refill it might well be held by whoever would have to
+ * trim the device it is waiting on. It gets -ENOMEM instead. Devices
+ * whose geometry is changed later on use the generic allocators.
+ *
+ * Quanta that are a whole number of pages come from the page
+ * allocator, so that scull_mmap can hand the pages to user space.
+ * Huge quanta are compound pages, when memory is not too fragmented
+ * to find one: otherwise they are vmalloc'ed, small pages that need
+ * not be contiguous, and scull_quantum_page finds the page behind
+ * any byte of them either way.
+ * Quanta always start out zeroed, so nothing stale leaks out of a
+ * partially written quantum.
+ *
+ * Whatever a writer makes us allocate is charged to its memory
+ * cgroup, where the kernel supports it. Elements that mempools keep
+ * in reserve are not, so there the reserves are left alone: a writer
+ * at its limit must get the error, not some memory nobody pays for.
+ */
+#ifdef GFP_KERNEL_ACCOUNT
+#define SCULL_CHARGED 1
+#else
+#define GFP_KERNEL_ACCOUNT GFP_KERNEL
+#define SCULL_CHARGED 0
+#endif
+
+static struct kmem_cache *scull_qset_cache;     /* struct scull_qset */
+static struct kmem_cache *scull_data_cache;     /* quantum-set arrays */
+static struct kmem_cache *scull_quantum_cache;  /* quanta, if not paged */
+static mempool_t *scull_qset_pool;
+static mempool_t *scull_data_pool;
+static mempool_t *scull_quantum_pool;
+static int scull_pool_quantum;  /* the sizes the pools were made for */
+static int scull_pool_qset;
+
+int scull_quantum_paged(int quantum) {
+   return quantum > 0 && (quantum & ~PAGE_MASK) == 0;
+}
+
+int scull_quantum_huge(int quantum) {
+   return quantum == SCULL_HUGE_QUANTUM;
+}
+
+struct page *scull_quantum_page(void *p) {
+   if (is_vmalloc_addr(p))
+      return vmalloc_to_page(p);
+   return virt_to_page(p);
+}
+
+static void *scull_alloc_pages(int quantum, gfp_t gfp_mask, int node) {
+   struct page *page;
+   
+   if (scull_quantum_huge(quantum)) {
+      /* don't try hard: small pages do the job too */
+      page = alloc_pages_node(node, gfp_mask | __GFP_COMP | __GFP_NOWARN |
+			      __GFP_NORETRY, get_order(quantum));
+      if (page)
+	 return page_address(page);
+      if (gfp_mask & __GFP_NORETRY)
+	 return NULL; /* just a try on a node: the caller goes on */
+      return __vmalloc(quantum, gfp_mask | __GFP_HIGHMEM, PAGE_KERNEL);
+   }
+   if (node == NUMA_NO_NODE)
+      return alloc_pages_exact(quantum, gfp_mask);
+   return alloc_pages_exact_nid(node, quantum, gfp_mask);
+}
+
+static void scull_free_pages(void *q, int quantum) {
+   struct page *page;
+   
+   if (is_vmalloc_addr(q)) {
+      vfree(q);
+      return;
+   }
+   page = virt_to_page(q);
+   if (PageCompound(page))
+      __free_pages(page, get_order(quantum));
+   else
+      free_pages_exact(q, quantum);
+}
+
+/*
+ * Does anybody else (a pipe we spliced to) still hold pages of this
+ * quantum? Then they must not be reused for anything else.
+ */
+static int scull_pages_busy(void *q, int quantum) {
+   struct page *page = scull_quantum_page(q);
+   int i;
+   
+   if (PageCompound(page))
+      return page_count(page) > 1;
+   for (i = 0; i < quantum >> PAGE_SHIFT; i++)
+      if (page_count(scull_quantum_page(q + (i << PAGE_SHIFT))) > 1)
+	 return 1;
+   return 0;
+}
+
+static void *scull_pool_alloc_pages(gfp_t gfp_mask, void *pool_data) {
+   return scull_alloc_pages((long) pool_data, gfp_mask, NUMA_NO_NODE);
+}
+
+static void scull_pool_free_pages(void *element, void *pool_data) {
+   scull_free_pages(element, (long) pool_data);
+}
+
+/*
+ * Which node the memory of an item of dev should come from:
+ * NUMA_NO_NODE for the one the writer runs on. Interleaved devices
+ * spread their items over the online nodes in turn, so that a large
+ * device doesn't fill up one node and every node reads some of it
+ * locally.
+ */
+static int scull_node_valid(int node) {
+   if (node == SCULL_NODE_LOCAL || node == SCULL_NODE_INTERLEAVE)
+      return 1;
+   return node >= 0 && node < MAX_NUMNODES && node_online(node);
+}
+
+static int scull_item_node(struct scull_dev *dev, unsigned long item) {
+   int node = ACCESS_ONCE(dev->node), n;
+   
+   if (node != SCULL_NODE_INTERLEAVE)
+      return node; /* SCULL_NODE_LOCAL is NUMA_NO_NODE */
+   n = item % num_online_nodes();
+   for_each_online_node(node)
+      if (!n--)
+	 return node;
+   return NUMA_NO_NODE; /* one went offline meanwhile */
+}
+
+/*
+ * A device bound to a node (see scull_item_node) gets its memory
+ * there if the node has any to spare; otherwise, and for the others,
+ * it comes from the caches wherever there is some, and from the pool
+ * reserves as a last resort where nothing is charged. What comes from the caches goes back to
+ * the pools like the rest.
+ */
+#define SCULL_GFP_NODE (GFP_KERNEL_ACCOUNT | __GFP_NOWARN | __GFP_NORETRY)
+
+static void *scull_pool_take(mempool_t *pool) {
+   if (SCULL_CHARGED)
+      return NULL; /* or the limit would be lifted */
+   return mempool_alloc(pool, GFP_NOWAIT); /* don't wait for a refill */
+}
+
+void *scull_alloc_quantum(int quantum, int node) {
+   void *q = NULL;
+   
+   if (quantum == scull_pool_quantum) {
+      if (node != NUMA_NO_NODE && scull_quantum_paged(quantum))
+	 q = scull_alloc_pages(quantum, SCULL_GFP_NODE, node);
+      else if (node != NUMA_NO_NODE)
+	 q = kmem_cache_alloc_node(scull_quantum_cache, SCULL_GFP_NODE,
+				   node);
+      if (!q && scull_quantum_paged(quantum))
+	 q = scull_alloc_pages(quantum, GFP_KERNEL_ACCOUNT, NUMA_NO_NODE);
+      else if (!q)
+	 q = kmem_cache_alloc(scull_quantum_cache, GFP_KERNEL_ACCOUNT);
+      if (!q)
+	 q = scull_pool_take(scull_quantum_pool);
+   } else if (scull_quantum_paged(quantum))
+      q = scull_alloc_pages(quantum, GFP_KERNEL_ACCOUNT, node);
+   else
+      q = kmalloc_node(quantum, GFP_KERNEL_ACCOUNT, node);
+   if (q)
+      memset(q, 0, quantum);
+   return q;
+}
+
+void scull_free_quantum(void *q, int quantum) {
+   if (!q)
+      return;
+   if (SCULL_ZQUANTUM(q))
+      scull_zfree(q);
+   else if (SCULL_SQUANTUM(q))
+      scull_sput(q);
+   else if (scull_quantum_paged(quantum) &&
+	    (quantum != scull_pool_quantum || scull_pages_busy(q, quantum)))
+      scull_free_pages(q, quantum); /* not back to the pool if spliced */
+   else if (quantum == scull_pool_quantum)
+      mempool_free(q, scull_quantum_pool);
+   else
+      kfree(q);
+}
+
+static void **scull_alloc_qset_data(int qset, int node) {
+   void **data = NULL;
+   
+   if (qset == scull_pool_qset) {
+      if (node != NUMA_NO_NODE)
+	 data = kmem_cache_alloc_node(scull_data_cache, SCULL_GFP_NODE, node);
+      if (!data)
+	 data = kmem_cache_alloc(scull_data_cache, GFP_KERNEL_ACCOUNT);
+      if (!data)
+	 data = scull_pool_take(scull_data_pool);
+   } else
+      data = kmalloc_node(qset * sizeof(void *), GFP_KERNEL_ACCOUNT, node);
+   if (data)
+      memset(data, 0, qset * sizeof(void *));
+   return data;
+}
+
+static void scull_free_qset_data(void **data, int qset) {
+   if (qset == scull_pool_qset)
+      mempool_free(data, scull_data_pool);
+   else
+      kfree(data);
+}
+
+static void scull_destroy_caches(void) {
+   scull_pool_quantum = scull_pool_qset = 0;
+   if (scull_quantum_pool)
+      mempool_destroy(scull_quantum_pool);
+   if (scull_data_pool)
+      mempool_destroy(scull_data_pool);
+   if (scull_qset_pool)
+      mempool_destroy(scull_qset_pool);
+   if (scull_quantum_cache)
+      kmem_cache_destroy(scull_quantum_cache);
+   if (scull_data_cache)
+      kmem_cache_destroy(scull_data_cache);
+   if (scull_qset_cache)
+      kmem_cache_destroy(scull_qset_cache);
+}
+
+static int scull_create_caches(void) {
+   scull_qset_cache = kmem_cache_create("scull_qset",
+			sizeof(struct scull_qset), 0, 0, NULL);
+   scull_data_cache = kmem_cache_create("scull_qset_data",
+			scull_qset * sizeof(void *), 0, 0, NULL);
+   if (!scull_qset_cache || !scull_data_cache)
+      return -ENOMEM;
+   scull_qset_pool = mempool_create_slab_pool(SCULL_POOL_MIN,
+					      scull_qset_cache);
+   scull_data_pool = mempool_create_slab_pool(SCULL_POOL_MIN,
+					      scull_data_cache);
+   
+   if (scull_quantum_paged(scull_quantum)) {
+      scull_quantum_pool = mempool_create(
+				scull_quantum_huge(scull_quantum) ?
+				SCULL_HUGE_POOL_MIN : SCULL_POOL_MIN,
+				scull_pool_alloc_pages, scull_pool_free_pages,
+				(void *)(long) scull_quantum);
+   } else {
+      scull_quantum_cache = kmem_cache_create("scull_quantum",
+				scull_quantum, 0, 0, NULL);
+      if (!scull_quantum_cache)
+	 return -ENOMEM;
+      scull_quantum_pool = mempool_create_slab_pool(SCULL_POOL_MIN,
+						    scull_quantum_cache);
+   }
+   if (!scull_qset_pool || !scull_data_pool || !scull_quantum_pool)
+      return -ENOMEM;
+   
+   scull_pool_quantum = scull_quantum;
+   scull_pool_qset = scull_qset;
+   return 0;
+}
+
+/*
+ * Prepare a zeroed scull_dev for use.
+ */
+void scull_init_dev(struct scull_dev *dev) {
+   dev->quantum = scull_quantum;
+   dev->qset = scull_qset;
+   dev->limit = scull_limit;
+   dev->node = scull_node;
+   INIT_RADIX_TREE(&dev->index, GFP_ATOMIC); /* inserts are preloaded */
+   init_rwsem(&dev->sem);
+   spin_lock_init(&dev->lock);
+   seqcount_init(&dev->seq);
+   init_waitqueue_head(&dev->trimq);
+}
+
+/*
+ * An array shared with a snapshot is counted as a whole, not quantum
+ * by quantum: the last item to let go of it frees all of it. An item
+ * lets go once no reader of its device can see the array any more.
+ */
+static void scull_sarray_put(struct scull_sarray *sa) {
+   int i;
+   
+   if (!atomic_dec_and_test(&sa->refs))
+      return;
+   for (i = 0; i < sa->qset; i++)
+      scull_free_quantum(sa->data[i], sa->quantum);
+   scull_free_qset_data(sa->data, sa->qset);
+   kfree(sa);
+}
+
+static void scull_sarray_free(struct rcu_head *head) {
+   scull_sarray_put(container_of(head, struct scull_sarray, rcu));
+}
+
+/*
+ * Free every item of a detached index, with the geometry it was
+ * built with. No reader may be looking at it any more.
+ */
+static void scull_free_items(struct radix_tree_root *index,
+			     int quantum, int qset) {
+   struct scull_qset *batch[16];
+   unsigned long item = 0;
+   int i, j, n;
+   
+   /* all the items, a batch at a time */
+   while ((n = radix_tree_gang_lookup(index, (void **) batch,
+				      item, ARRAY_SIZE(batch)))) {
+      for (j = 0; j < n; j++) {
+	 struct scull_qset *dptr = batch[j];
+	 
+	 if (dptr->shared) {
+	    scull_sarray_put(dptr->shared);
+	 } else if (dptr->data) {
+	    for (i = 0; i < qset; i++)
+	       scull_free_quantum(dptr->data[i], quantum);
+	    scull_free_qset_data(dptr->data, qset);
+	 }
+	 item = dptr->item + 1;
+	 radix_tree_delete(index, dptr->item);
+	 mempool_free(dptr, scull_qset_pool);
+      }
+   }
+}
+
+/*
+ * A quantum taken out of a live device may still be under a lockless
+ * reader: hand it over here, and it is freed after a grace period.
+ */
+struct scull_retired {
+   struct rcu_head rcu;
+   void *q;
+   int quantum;
+};
+
+static void scull_retired_free(struct rcu_head *head) {
+   struct scull_retired *r = container_of(head, struct scull_retired, rcu);
+   
+   scull_free_quantum(r->q, r->quantum);
+   kfree(r);
+}
+
+void scull_retire_quantum(void *q, int quantum) {
+   struct scull_retired *r = kmalloc(sizeof(*r), GFP_KERNEL);
+   
+   if (!r) { /* do it the slow way */
+      synchronize_srcu(&scull_srcu);
+      scull_free_quantum(q, quantum);
+      return;
+   }
+   r->q = q;
+   r->quantum = quantum;
+   call_srcu(&scull_srcu, &r->rcu, scull_retired_free);
+}
+
+/*
+ * What scull_trim (or a relayout) leaves behind: the detached index,
+ * freed from our workqueue once no reader can see it any more. Until
+ * then the bytes of its quanta are counted in dev->trimming, for
+ * whoever wants to wait for them.
+ */
+struct scull_trimmed {
+   struct work_struct work;
+   struct radix_tree_root index;
+   int quantum, qset;
+   long bytes;
+   struct scull_dev *dev;
+};
+
+static struct workqueue_struct *scull_wq; /* trims and relayouts */
+
+static void scull_trim_work(struct work_struct *work) {
+   struct scull_trimmed *t = container_of(work, struct scull_trimmed, work);
+   struct scull_dev *dev = t->dev;
+   
+   synchronize_srcu(&scull_srcu);
+   scull_free_items(&t->index, t->quantum, t->qset);
+   if (atomic_long_sub_and_test(t->bytes, &dev->trimming))
+      wake_up_interruptible(&dev->trimq);
+   kfree(t);
+}
+
+/*
+ * Wait for every earlier trim and relayout to be done with. Needed
+ * before a device structure itself goes away.
+ */
+void scull_flush_work(void) {
+   if (scull_wq)
+      drain_workqueue(scull_wq); /* relayouts queue trims of their own */
+}
+
+/*
+ * Get rid of an index that has been detached from dev, with the
+ * geometry it had and the bytes its quanta take: the workqueue does
+ * it, so that however big the index, this costs the same.
+ */
+static void scull_retire_index(struct scull_dev *dev,
+			       struct radix_tree_root *old, int quantum,
+			       int qset, long bytes) {
+   struct scull_trimmed *t;
+   struct scull_qset *dptr;
+   
+   if (!radix_tree_gang_lookup(old, (void **) &dptr, 0, 1))
+      return; /* it was empty already */
+   
+   t = scull_wq ? kmalloc(sizeof(*t), GFP_KERNEL) : NULL;
+   if (!t) { /* do it here and now */
+      synchronize_srcu(&scull_srcu);
+      scull_free_items(old, quantum, qset);
+      return;
+   }
+   INIT_WORK(&t->work, scull_trim_work);
+   t->index = *old;
+   t->quantum = quantum;
+   t->qset = qset;
+   t->bytes = bytes;
+   t->dev = dev;
+   atomic_long_add(bytes, &dev->trimming);
+   queue_work(scull_wq, &t->work);
+}
+
 /*
  * Empty out the scull device; must be called with the device
- * semaphore held.
+ * semaphore held for writing. The whole index is detached at once,
+ * under dev->seq so that lockless readers notice, and retired.
+ * Unless the device was given a geometry of its own, it picks up
+ * the current global one.
  */
 int scull_trim(struct scull_dev *dev) {
-   struct scull_qset *next, *dptr;
+   struct radix_tree_root old;
+   long bytes;
    int qset = dev->qset;   /* "dev" is not-null */
-   int i;
+   int quantum = dev->quantum;
+   u64 start = scull_trace_clock(scull_trim_end);
    
-   for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
-      if (dptr->data) {
-	 for (i = 0; i < qset; i++)
-	    kfree(dptr->data[i]);
-	 kfree(dptr->data);
-	 dptr->data = NULL;
-      }
-      next = dptr->next;
-      kfree(dptr);
+   trace_scull_trim_start(dev->cdev.dev, dev->size,
+			  atomic_long_read(&dev->used));
+   if (atomic_read(&dev->vmas)) { /* don't trim: there are active mappings */
+      trace_scull_trim_end(dev->cdev.dev, -EBUSY, scull_trace_since(start));
+      return -EBUSY;
    }
+   
+   write_seqcount_begin(&dev->seq);
+   old = dev->index;
+   INIT_RADIX_TREE(&dev->index, GFP_ATOMIC);
    dev->size = 0;
-   dev->quantum = scull_quantum;
-   dev->qset = scull_qset;
-   dev->data = NULL;
+   if (!dev->own_geometry) {
+      dev->quantum = scull_quantum;
+      dev->qset = scull_qset;
+   }
+   write_seqcount_end(&dev->seq);
+   bytes = atomic_long_xchg(&dev->used, 0);
+   scull_stat_add(dev, trims, 1);
+   
+   scull_retire_index(dev, &old, quantum, qset, bytes);
+   trace_scull_trim_end(dev->cdev.dev, 0, scull_trace_since(start));
    return 0;
 }
 #ifdef SCULL_DEBUG /* use proc only if debugging */
@@ -90,23 +571,26 @@ int scull_read_procmem(char *buf, char **start, off_t offset,
    
    for (i = 0; i < scull_nr_devs && len <= limit; i++) {
       struct scull_dev *d = &scull_devices[i];
-      struct scull_qset *qs = d->data;
-      if (down_interruptible(&d->sem))
-	 return -ERESTARTSYS;
+      struct scull_qset *qs, *last = NULL;
+      unsigned long item = 0;
+      down_read(&d->sem);
       len += sprintf(buf+len,"\nDevice %i: qset %i, q %i, sz %li\n",
 		     i, d->qset, d->quantum, d->size);
-      for (; qs && len <= limit; qs = qs->next) { /* scan the list */
-	 len += sprintf(buf + len, "  item at %p, qset at %p\n",
-			qs, qs->data);
-	 if (qs->data && !qs->next) /* dump only the last item */
-	    for (j = 0; j < d->qset; j++) {
-	       if (qs->data[j])
-		  len += sprintf(buf + len,
-				 "    % 4i: %8p\n",
-				 j, qs->data[j]);
-	    }
+      while (len <= limit && radix_tree_gang_lookup(&d->index,
+				(void **) &qs, item, 1)) { /* scan the items */
+	 len += sprintf(buf + len, "  item %lu at %p, qset at %p\n",
+			qs->item, qs, qs->data);
+	 item = qs->item + 1;
+	 last = qs;
       }
-      up(&scull_devices[i].sem);
+      if (last && last->data) /* dump only the last item */
+	 for (j = 0; j < d->qset && len <= limit; j++) {
+	    if (last->data[j])
+	       len += sprintf(buf + len,
+			      "    % 4i: %8p\n",
+			      j, last->data[j]);
+	 }
+      up_read(&scull_devices[i].sem);
    }
    *eof = 1;
    return len;
@@ -139,23 +623,26 @@ static void scull_seq_stop(struct seq_file *s, void *v) {
 
 static int scull_seq_show(struct seq_file *s, void *v) {
    struct scull_dev *dev = (struct scull_dev *) v;
-   struct scull_qset *d;
+   struct scull_qset *d, *last = NULL;
+   unsigned long item = 0;
    int i;
    
-   if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
+   down_read(&dev->sem);
    seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
 	      (int) (dev - scull_devices), dev->qset,
 	      dev->quantum, dev->size);
-   for (d = dev->data; d; d = d->next) { /* scan the list */
-      seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
-      if (d->data && !d->next) /* dump only the last item */
-	 for (i = 0; i < dev->qset; i++) {
-	    if (d->data[i])
-	       seq_printf(s, "    % 4i: %8p\n",
-			  i, d->data[i]);
-	 }
+   while (radix_tree_gang_lookup(&dev->index, (void **) &d, item, 1)) {
+      seq_printf(s, "  item %lu at %p, qset at %p\n", d->item, d, d->data);
+      item = d->item + 1;
+      last = d;
    }
-   up(&dev->sem);
+   if (last && last->data) /* dump only the last item */
+      for (i = 0; i < dev->qset; i++) {
+	 if (last->data[i])
+	    seq_printf(s, "    % 4i: %8p\n",
+		       i, last->data[i]);
+      }
+   up_read(&dev->sem);
    return 0;
 }
          
@@ -221,10 +708,9 @@ int scull_open(struct inode *inode, struct file *filp) {
    
    /* now trim to 0 the length of the device if open was write-only */
    if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-      if (down_interruptible(&dev->sem))
-	 return -ERESTARTSYS;
+      down_write(&dev->sem);
       scull_trim(dev); /* ignore errors */
-      up(&dev->sem);
+      up_write(&dev->sem);
    }
    return 0;          /* success */
 }
@@ -233,75 +719,459 @@ int scull_release(struct inode *inode, struct file *filp) {
    return 0;
 }
 /*
- * Follow the list
+ * Look up the n-th item, without allocating anything.
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n) {
-   struct scull_qset *qs = dev->data;
+static struct scull_qset *scull_lookup(struct scull_dev *dev, unsigned long n) {
+   struct scull_qset *qs;
+   
+   rcu_read_lock();
+   qs = radix_tree_lookup(&dev->index, n);
+   rcu_read_unlock();
+   return qs;
+}
+
+/*
+ * Find the n-th item, allocating it if need be. The radix tree
+ * gets us there in O(log n) instead of walking every item before it.
+ *
+ * Must be called with the device semaphore held, for reading at
+ * least: items only go away in scull_trim, and concurrent writers
+ * only ever add to the tree, under dev->lock.
+ */
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long n) {
+   struct scull_qset *qs, *old;
+   int node;
  
-   /* Allocate first qset explicitly if need be */
-   if (! qs) {
-      qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-      if (qs == NULL)
-	 return NULL;  /* Never mind */
-      memset(qs, 0, sizeof(struct scull_qset));
-   }
-   
-   /* Then follow the list */
-   while (n--) {
-      if (!qs->next) {
-	 qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-	 if (qs->next == NULL)
-	    return NULL;  /* Never mind */
-	 memset(qs->next, 0, sizeof(struct scull_qset));
-      }
-      qs = qs->next;
-      continue;
+   qs = scull_lookup(dev, n);
+   if (qs)
+      return qs;
+   
+   node = scull_item_node(dev, n);
+   qs = NULL;
+   if (node != NUMA_NO_NODE)
+      qs = kmem_cache_alloc_node(scull_qset_cache, SCULL_GFP_NODE, node);
+   if (!qs)
+      qs = kmem_cache_alloc(scull_qset_cache, GFP_KERNEL_ACCOUNT);
+   if (!qs)
+      qs = scull_pool_take(scull_qset_pool);
+   if (qs == NULL)
+      return NULL;  /* Never mind */
+   memset(qs, 0, sizeof(struct scull_qset));
+   qs->item = n;
+   qs->stamp = jiffies;
+   mutex_init(&qs->mutex);
+   if (radix_tree_preload(GFP_KERNEL)) {
+      mempool_free(qs, scull_qset_pool);
+      return NULL;
+   }
+   
+   /* somebody else may have raced us here */
+   spin_lock(&dev->lock);
+   old = radix_tree_lookup(&dev->index, n);
+   if (!old && radix_tree_insert(&dev->index, n, qs))
+      old = ERR_PTR(-ENOMEM);
+   spin_unlock(&dev->lock);
+   radix_tree_preload_end();
+   
+   if (old) {
+      mempool_free(qs, scull_qset_pool);
+      return IS_ERR(old) ? NULL : old;
    }
    return qs;
 }
 
+/*
+ * Give an item an array of its own before it is changed. If no other
+ * device holds the shared one any more, it is simply taken back.
+ * Otherwise it is copied, and each quantum in it becomes shared by
+ * itself: O(qset), once per item written after a snapshot, instead of
+ * at the snapshot. Called with the item mutex held, by the device
+ * that writes; snapshots never do, so it is the only one to change
+ * the shared array meanwhile.
+ */
+/*
+ * Once the snapshots that shared an item's array are all gone, the
+ * array is the item's own again, and can be taken back as it is.
+ * Returns whether the item owns its array now. Item mutex held.
+ */
+int scull_sarray_reclaim(struct scull_qset *dptr) {
+   struct scull_sarray *sa = dptr->shared;
+   
+   if (!sa)
+      return 1;
+   if (atomic_read(&sa->refs) != 1)
+      return 0;
+   dptr->shared = NULL;
+   kfree(sa);
+   return 1;
+}
+
+static int scull_unshare(struct scull_dev *dev, struct scull_qset *dptr) {
+   struct scull_sarray *sa = dptr->shared;
+   void **data, *q;
+   int s_pos;
+   
+   if (scull_sarray_reclaim(dptr))
+      return 0;
+   data = scull_alloc_qset_data(sa->qset, scull_item_node(dev, dptr->item));
+   if (!data)
+      return -ENOMEM;
+   for (s_pos = 0; s_pos < sa->qset; s_pos++) {
+      q = sa->data[s_pos];
+      if (q && !SCULL_SQUANTUM(q)) { /* readers may go on using q itself */
+	 q = scull_swrap(q, sa->quantum);
+	 if (!q)
+	    goto nomem;
+	 rcu_assign_pointer(sa->data[s_pos], q);
+      }
+      data[s_pos] = q ? scull_sget(q) : NULL;
+   }
+   rcu_assign_pointer(dptr->data, data);
+   dptr->shared = NULL;
+   call_srcu(&scull_srcu, &sa->rcu, scull_sarray_free); /* after our readers */
+   return 0;
+   
+ nomem: /* what was wrapped stays so, it's shared all the same */
+   while (s_pos--)
+      if (data[s_pos])
+	 scull_sput(data[s_pos]);
+   scull_free_qset_data(data, sa->qset);
+   return -ENOMEM;
+}
+
+/*
+ * Return the s_pos-th quantum of an item, allocating whatever is
+ * missing on the way. Must be called with the item's mutex held.
+ * Readers look at the arrays without any lock, so only publish
+ * memory once it is initialized. A new quantum is counted against
+ * the device limit first: ERR_PTR(-ENOSPC) if it does not fit,
+ * ERR_PTR(-ENOMEM) if there is no memory for it. A compressed one is
+ * decompressed for good, and a shared one copied (unless no other
+ * slot shares it any more), as the caller is going to change it.
+ */
+void *scull_quantum_at(struct scull_dev *dev, struct scull_qset *dptr,
+		       int s_pos) {
+   void **data;
+   void *q, *shared;
+   int node = scull_item_node(dev, dptr->item);
+   int err;
+   
+   if (dptr->shared && (err = scull_unshare(dev, dptr)))
+      return ERR_PTR(err);
+   if (!dptr->data) {
+      data = scull_alloc_qset_data(dev->qset, node);
+      if (!data)
+	 return ERR_PTR(-ENOMEM);
+      rcu_assign_pointer(dptr->data, data);
+   }
+   q = dptr->data[s_pos];
+   if (q && SCULL_SQUANTUM(q) && (shared = scull_sunwrap(q)))
+      rcu_assign_pointer(dptr->data[s_pos], shared); /* ours alone again */
+   if (!dptr->data[s_pos]) {
+      if (atomic_long_add_return(dev->quantum, &dev->used) > dev->limit &&
+	  dev->limit) {
+	 atomic_long_sub(dev->quantum, &dev->used);
+	 return ERR_PTR(-ENOSPC);
+      }
+      q = scull_alloc_quantum(dev->quantum, node);
+      if (!q) {
+	 atomic_long_sub(dev->quantum, &dev->used);
+	 return ERR_PTR(-ENOMEM);
+      }
+      rcu_assign_pointer(dptr->data[s_pos], q);
+   } else if (SCULL_ZQUANTUM(dptr->data[s_pos])) {
+      q = scull_alloc_quantum(dev->quantum, node);
+      if (!q)
+	 return ERR_PTR(-ENOMEM);
+      if (scull_zunpack(dptr->data[s_pos], q, dev->quantum)) {
+	 scull_free_quantum(q, dev->quantum);
+	 return ERR_PTR(-EIO);
+      }
+      scull_retire_quantum(dptr->data[s_pos], dev->quantum);
+      rcu_assign_pointer(dptr->data[s_pos], q);
+   } else if (SCULL_SQUANTUM(dptr->data[s_pos])) { /* copy on write */
+      q = scull_alloc_quantum(dev->quantum, node);
+      if (!q)
+	 return ERR_PTR(-ENOMEM);
+      shared = scull_sdata(dptr->data[s_pos]);
+      if (!SCULL_ZQUANTUM(shared))
+	 memcpy(q, shared, dev->quantum);
+      else if (scull_zunpack(shared, q, dev->quantum)) {
+	 scull_free_quantum(q, dev->quantum);
+	 return ERR_PTR(-EIO);
+      }
+      scull_retire_quantum(dptr->data[s_pos], dev->quantum);
+      rcu_assign_pointer(dptr->data[s_pos], q);
+   }
+   dptr->stamp = jiffies; /* not cold any more */
+   dptr->dirty = 1; /* for a relayout under way */
+   return dptr->data[s_pos];
+}
+
 /*
  * Data management: read and write
  */
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-		   loff_t *f_pos) {
-   struct scull_dev *dev = filp->private_data; 
-   struct scull_qset *dptr;        /* the first listitem */
-   int quantum = dev->quantum, qset = dev->qset;
-   int itemsize = quantum * qset; /* how many bytes in the listitem */
-   int item, s_pos, q_pos, rest;
-   ssize_t retval = 0;
+
+/*
+ * Take the device semaphore on behalf of a write. Writers only share
+ * it, so they only exclude trimming; they are kept apart by the mutex
+ * of each item they touch, so that writes to different quantum sets
+ * go on in parallel. Readers don't take it at all.
+ *
+ * Callers that asked not to block -- O_NONBLOCK, or a truly
+ * asynchronous iocb -- get -EAGAIN instead of waiting for it, and
+ * scull_do_write keeps to the same rule for the item mutex. Nothing
+ * else changes for them: quanta are allocated as for anybody.
+ */
+static int scull_nowait(struct file *filp, struct kiocb *iocb) {
+   return (filp->f_flags & O_NONBLOCK) || (iocb && !is_sync_kiocb(iocb));
+}
+
+static int scull_lock_io(struct scull_dev *dev, struct file *filp,
+			 struct kiocb *iocb) {
+   ktime_t start;
+   u64 ns;
    
-   if (down_interruptible(&dev->sem))
-      return -ERESTARTSYS;
-   if (*f_pos >= dev->size) goto out;
-   if (*f_pos + count > dev->size)
-      count = dev->size - *f_pos;
+   if (scull_nowait(filp, iocb))
+      return down_read_trylock(&dev->sem) ? 0 : -EAGAIN;
+   if (down_read_trylock(&dev->sem))
+      return 0; /* no waiting, no need for the clock */
+   start = ktime_get();
+   down_read(&dev->sem);
+   ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+   scull_stat_add(dev, semwait, ns);
+   trace_scull_sem_wait(dev->cdev.dev, ns);
+   return 0;
+}
+
+/*
+ * Copy up to count bytes from *f_pos to user space, walking across
+ * quanta and quantum sets as needed. Must be called inside a
+ * scull_srcu read-side section.
+ *
+ * No lock is taken: if a trim comes by while we are at it (it may
+ * change the geometry, too), dev->seq tells us, and the whole read
+ * is started over. An item is only used once we know it belongs
+ * to the geometry we computed our position with.
+ */
+static ssize_t scull_do_read(struct scull_dev *dev, char __user *buf,
+			     size_t count, loff_t *f_pos) {
+   struct scull_qset *dptr;        /* the item holding *f_pos */
+   void **data;
+   char *q;
+   int quantum, qset;
+   long itemsize, item;
+   int s_pos, q_pos, rest;
+   unsigned long size;
+   size_t chunk, todo, done;
+   unsigned seq;
+   int err;
+   
+ retry:
+   seq = read_seqcount_begin(&dev->seq);
+   quantum = dev->quantum;
+   qset = dev->qset;
+   size = dev->size;
+   itemsize = (long)quantum * qset; /* how many bytes in the listitem */
+   done = 0;
+   
+   if (*f_pos >= size) return 0;
+   todo = min(count, (size_t)(size - *f_pos));
    
    /* find listitem, qset index, and offset in the quantum */
    item = (long)*f_pos / itemsize;
    rest = (long)*f_pos % itemsize;
    s_pos = rest / quantum; q_pos = rest % quantum;
    
-   /* follow the list up to the right position (defined elsewhere) */
-   dptr = scull_follow(dev, item);
+   /* look the item up; reading never allocates */
+   dptr = scull_lookup(dev, item);
+   if (read_seqcount_retry(&dev->seq, seq))
+      goto retry;
    
-   if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-      goto out; /* don't fill holes */
+   while (done < todo) {
+      data = dptr ? srcu_dereference(dptr->data, &scull_srcu) : NULL;
+      q = data ? srcu_dereference(data[s_pos], &scull_srcu) : NULL;
+      
+      /* the rest of this quantum, or what is left to read */
+      chunk = min(todo - done, (size_t)(quantum - q_pos));
+      if (q && SCULL_SQUANTUM(q)) /* may be compressed as well */
+	 q = scull_sdata(q);
+      if (q == NULL) /* holes read as 0 */
+	 err = clear_user(buf + done, chunk) ? -EFAULT : 0;
+      else if (SCULL_ZQUANTUM(q))
+	 err = scull_zread(buf + done, q, q_pos, chunk, quantum);
+      else
+	 err = copy_to_user(buf + done, q + q_pos, chunk) ? -EFAULT : 0;
+      if (err) {
+	 if (!done)
+	    return err;
+	 break;
+      }
+      done += chunk;
+      
+      /* on to the next quantum, and the next item if need be */
+      q_pos = 0;
+      if (++s_pos == qset) {
+	 s_pos = 0;
+	 dptr = scull_lookup(dev, ++item);
+	 if (read_seqcount_retry(&dev->seq, seq))
+	    goto retry;
+      }
+   }
+   *f_pos += done;
+   scull_stat_add(dev, reads, 1);
+   scull_stat_add(dev, rbytes, done);
+   return done;
+}
+
+/*
+ * A write is done with a quantum. If it was a hole that only got
+ * zeros, it goes back to being a hole (which reads the same); if it
+ * was written whole, it may be shared with an identical one. Quanta
+ * of a mapped device stay put, as user space may have their pages.
+ */
+static void scull_settle_quantum(struct scull_dev *dev,
+				 struct scull_qset *dptr, int s_pos,
+				 int fresh, int q_pos, size_t chunk) {
+   void *q = dptr->data[s_pos], *sq;
+   int quantum = dev->quantum;
    
-   /* read only up to the end of this quantum */
-   if (count > quantum - q_pos)
-      count = quantum - q_pos;
+   if (atomic_read(&dev->vmas))
+      return;
+   if (fresh && !memchr_inv(q + q_pos, 0, chunk)) {
+      rcu_assign_pointer(dptr->data[s_pos], NULL);
+      scull_retire_quantum(q, quantum);
+      atomic_long_sub(quantum, &dev->used);
+   } else if (chunk == quantum && (sq = scull_share(q, quantum))) {
+      rcu_assign_pointer(dptr->data[s_pos], sq);
+      if (scull_sdata(sq) != q) /* an older copy is used instead */
+	 scull_retire_quantum(q, quantum);
+   }
+}
+
+/*
+ * Copy count bytes from user space to *f_pos, allocating quanta and
+ * quantum sets as needed. Must be called with the device semaphore
+ * held for reading; each item is locked while we write into it.
+ *
+ * The user buffer is never faulted in with the item locked: it may
+ * be a mapping of this very device, and scull_vma_fault takes the
+ * semaphore and the item mutex too. If the copy comes short, what
+ * came is kept, both are let go of while the rest is faulted in,
+ * and the write goes on from there -- with the semaphore held again,
+ * as the caller expects, and the geometry looked up anew.
+ *
+ * With nowait, a busy item ends the write with -EAGAIN, or short,
+ * instead of being waited for. Quanta are still allocated as needed,
+ * and a fault on the user buffer may still sleep (and the semaphore
+ * be waited for after it), as it may for any non-blocking I/O.
+ */
+static ssize_t scull_do_write(struct scull_dev *dev, const char __user *buf,
+			      size_t count, loff_t *f_pos, int nowait) {
+   struct scull_qset *dptr = NULL;
+   char *q;
+   int quantum, qset;
+   long itemsize;
+   long item;
+   int s_pos, q_pos, rest, fresh;
+   size_t chunk, left, done = 0;
+   ssize_t retval = 0;
+   loff_t pos;
    
-   if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-      retval = -EFAULT;
-      goto out;
+   if (!access_ok(VERIFY_READ, buf, count))
+      return -EFAULT;
+ restart:
+   quantum = dev->quantum;
+   qset = dev->qset;
+   itemsize = (long)quantum * qset;
+   
+   /* find listitem, qset index and offset in the quantum */
+   pos = *f_pos + done;
+   item = (long)pos / itemsize;
+   rest = (long)pos % itemsize;
+   s_pos = rest / quantum; q_pos = rest % quantum;
+   
+   while (done < count) {
+      /* find (or create) the item holding this position, and lock it */
+      if (!dptr) {
+	 dptr = scull_follow(dev, item);
+	 if (dptr == NULL) {
+	    retval = -ENOMEM;
+	    break;
+	 }
+	 if (!nowait) {
+	    mutex_lock(&dptr->mutex);
+	 } else if (!mutex_trylock(&dptr->mutex)) {
+	    dptr = NULL;
+	    retval = -EAGAIN;
+	    break;
+	 }
+      }
+      fresh = !dptr->data || !dptr->data[s_pos];
+      q = scull_quantum_at(dev, dptr, s_pos);
+      if (IS_ERR(q)) {
+	 retval = PTR_ERR(q);
+	 break;
+      }
+      chunk = min(count - done, (size_t)(quantum - q_pos));
+      pagefault_disable(); /* see above */
+      left = __copy_from_user_inatomic(q + q_pos, buf + done, chunk);
+      pagefault_enable();
+      scull_settle_quantum(dev, dptr, s_pos, fresh, q_pos, chunk - left);
+      done += chunk - left;
+      if (left) {
+	 mutex_unlock(&dptr->mutex);
+	 dptr = NULL;
+	 up_read(&dev->sem);
+	 left = fault_in_pages_readable(buf + done,
+					min_t(size_t, count - done, PAGE_SIZE));
+	 down_read(&dev->sem);
+	 if (left) {
+	    retval = -EFAULT;
+	    break;
+	 }
+	 goto restart;
+      }
+      
+      q_pos = 0;
+      if (++s_pos == qset) {
+	 s_pos = 0;
+	 item++;
+	 mutex_unlock(&dptr->mutex);
+	 dptr = NULL;
+      }
    }
-   *f_pos += count;
-   retval = count;
+   if (dptr)
+      mutex_unlock(&dptr->mutex);
+   if (retval == -ENOMEM)
+      scull_stat_add(dev, nomem, 1);
+   if (!done)
+      return retval;
+   *f_pos += done;
+   scull_stat_add(dev, writes, 1);
+   scull_stat_add(dev, wbytes, done);
    
- out:
-   up(&dev->sem);
+   /* update the size */
+   spin_lock(&dev->lock);
+   if (dev->size < *f_pos)
+      dev->size = *f_pos;
+   spin_unlock(&dev->lock);
+   return done;
+}
+
+ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
+		   loff_t *f_pos) {
+   struct scull_dev *dev = filp->private_data; 
+   loff_t pos = *f_pos;
+   u64 start = scull_trace_clock(scull_read_end);
+   ssize_t retval;
+   int idx;
+   
+   trace_scull_read_start(dev->cdev.dev, pos, count);
+   idx = srcu_read_lock(&scull_srcu);
+   retval = scull_do_read(dev, buf, count, f_pos);
+   srcu_read_unlock(&scull_srcu, idx);
+   trace_scull_read_end(dev->cdev.dev, pos, retval, scull_trace_since(start));
    return retval;
 }
 
@@ -309,55 +1179,815 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 		    loff_t *f_pos)
 {
    struct scull_dev *dev = filp->private_data;
+   loff_t pos = *f_pos;
+   u64 start = scull_trace_clock(scull_write_end);
+   ssize_t retval;
+   
+   trace_scull_write_start(dev->cdev.dev, pos, count);
+   retval = scull_lock_io(dev, filp, NULL);
+   if (!retval) {
+      retval = scull_do_write(dev, buf, count, f_pos,
+			      scull_nowait(filp, NULL));
+      up_read(&dev->sem);
+   }
+   trace_scull_write_end(dev->cdev.dev, pos, retval, scull_trace_since(start));
+   return retval;
+}
+
+/*
+ * The vectored versions (readv, writev and aio) go through the whole
+ * iovec in one go: writes under a single hold of the semaphore, reads
+ * (which never block on the device) in a single SRCU section. They
+ * stop at the first short segment, like the plain read and write do.
+ */
+ssize_t scull_aio_read(struct kiocb *iocb, const struct iovec *iov,
+		       unsigned long nr_segs, loff_t pos) {
+   struct scull_dev *dev = iocb->ki_filp->private_data;
+   ssize_t retval = 0, done = 0;
+   unsigned long seg;
+   int idx;
+   
+   idx = srcu_read_lock(&scull_srcu);
+   for (seg = 0; seg < nr_segs; seg++) {
+      retval = scull_do_read(dev, iov[seg].iov_base, iov[seg].iov_len, &pos);
+      if (retval < 0)
+	 break;
+      done += retval;
+      if (retval < iov[seg].iov_len)
+	 break;
+   }
+   srcu_read_unlock(&scull_srcu, idx);
+   iocb->ki_pos = pos;
+   return done ? done : retval;
+}
+
+ssize_t scull_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			unsigned long nr_segs, loff_t pos) {
+   struct scull_dev *dev = iocb->ki_filp->private_data;
+   ssize_t retval, done = 0;
+   unsigned long seg;
+   
+   retval = scull_lock_io(dev, iocb->ki_filp, iocb);
+   if (retval)
+      return retval;
+   for (seg = 0; seg < nr_segs; seg++) {
+      retval = scull_do_write(dev, iov[seg].iov_base, iov[seg].iov_len, &pos,
+			      scull_nowait(iocb->ki_filp, iocb));
+      if (retval < 0)
+	 break;
+      done += retval;
+      if (retval < iov[seg].iov_len)
+	 break;
+   }
+   up_read(&dev->sem);
+   iocb->ki_pos = pos;
+   return done ? done : retval;
+}
+
+/*
+ * Reads and writes on behalf of the kernel itself, from and to kernel
+ * buffers. The rules are those of scull_do_read and scull_do_write:
+ * the caller of scull_kernel_write holds the semaphore.
+ */
+ssize_t scull_kernel_read(struct scull_dev *dev, void *buf, size_t count,
+			  loff_t pos) {
+   mm_segment_t old_fs = get_fs();
+   ssize_t retval;
+   int idx;
+   
+   set_fs(KERNEL_DS); /* scull_do_read copies "to user" */
+   idx = srcu_read_lock(&scull_srcu);
+   retval = scull_do_read(dev, (char __user *)buf, count, &pos);
+   srcu_read_unlock(&scull_srcu, idx);
+   set_fs(old_fs);
+   return retval;
+}
+
+ssize_t scull_kernel_write(struct scull_dev *dev, const void *buf,
+			   size_t count, loff_t pos) {
+   mm_segment_t old_fs = get_fs();
+   ssize_t retval;
+   
+   set_fs(KERNEL_DS); /* scull_do_write copies "from user" */
+   retval = scull_do_write(dev, (const char __user *)buf, count, &pos, 0);
+   set_fs(old_fs);
+   return retval;
+}
+
+/*
+ * splice and sendfile. Reading hands the pipe the pages of the quanta
+ * themselves, with a reference held: holes are the zero page, and
+ * only quanta that are not plain pages (small, or compressed) are
+ * copied. A quantum that goes away meanwhile is only freed with its
+ * pages once the pipe is done with them (see scull_free_quantum).
+ */
+static int scull_pipe_buf_steal(struct pipe_inode_info *pipe,
+				struct pipe_buffer *buf) {
+   return 1; /* the page is still ours */
+}
+
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+   .can_merge = 0,
+   .map =       generic_pipe_buf_map,
+   .unmap =     generic_pipe_buf_unmap,
+   .confirm =   generic_pipe_buf_confirm,
+   .release =   generic_pipe_buf_release,
+   .steal =     scull_pipe_buf_steal,
+   .get =       generic_pipe_buf_get,
+};
+
+static void scull_spd_release(struct splice_pipe_desc *spd, unsigned int i) {
+   put_page(spd->pages[i]);
+}
+
+/*
+ * The page for the next chunk of a splice, with a reference taken, and
+ * the chunk trimmed so as not to cross it. NULL if out of memory.
+ */
+static struct page *scull_splice_page(void *q, int quantum, int q_pos,
+				      size_t *chunk, unsigned int *offset) {
+   struct page *page;
+   
+   if (q && SCULL_SQUANTUM(q))
+      q = scull_sdata(q);
+   if (!q || (!SCULL_ZQUANTUM(q) && scull_quantum_paged(quantum))) {
+      page = q ? scull_quantum_page(q + q_pos) : ZERO_PAGE(0);
+      *offset = q ? offset_in_page(q + q_pos) : 0;
+      *chunk = min(*chunk, (size_t)(PAGE_SIZE - *offset));
+      get_page(page);
+      return page;
+   }
+   page = alloc_page(GFP_KERNEL);
+   if (!page)
+      return NULL;
+   *offset = 0;
+   *chunk = min(*chunk, (size_t)PAGE_SIZE);
+   if (!SCULL_ZQUANTUM(q))
+      memcpy(page_address(page), q + q_pos, *chunk);
+   else if (scull_zcopy(page_address(page), q, q_pos, *chunk, quantum)) {
+      put_page(page);
+      return NULL;
+   }
+   return page;
+}
+
+/*
+ * Fill spd with the pages for up to len bytes at pos; the same walk
+ * as scull_do_read, in a scull_srcu read-side section as well.
+ */
+static ssize_t scull_splice_fill(struct scull_dev *dev,
+				 struct splice_pipe_desc *spd,
+				 loff_t pos, size_t len) {
    struct scull_qset *dptr;
-   int quantum = dev->quantum, qset = dev->qset;
-   int itemsize = quantum * qset;
-   int item, s_pos, q_pos, rest;
-   ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
+   void **data;
+   char *q;
+   int quantum, qset;
+   long itemsize, item;
+   int s_pos, q_pos, rest;
+   unsigned long size;
+   size_t chunk, done;
+   unsigned int offset;
+   struct page *page;
+   unsigned seq;
    
-   if (down_interruptible(&dev->sem))
-      return -ERESTARTSYS;
+ retry:
+   while (spd->nr_pages) /* what a trim made stale */
+      put_page(spd->pages[--spd->nr_pages]);
+   seq = read_seqcount_begin(&dev->seq);
+   quantum = dev->quantum;
+   qset = dev->qset;
+   size = dev->size;
+   itemsize = (long)quantum * qset;
+   done = 0;
    
-   /* find listitem, qset index and offset in the quantum */
-   item = (long)*f_pos / itemsize;
-   rest = (long)*f_pos % itemsize;
+   if (pos >= size)
+      return 0;
+   len = min(len, (size_t)(size - pos));
+   item = (long)pos / itemsize;
+   rest = (long)pos % itemsize;
    s_pos = rest / quantum; q_pos = rest % quantum;
+   dptr = scull_lookup(dev, item);
+   if (read_seqcount_retry(&dev->seq, seq))
+      goto retry;
    
-   /* follow the list up to the right position */
-   dptr = scull_follow(dev, item);
-   if (dptr == NULL)
-      goto out;
-   if (!dptr->data) {
-      dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-      if (!dptr->data)
-	 goto out;
-      memset(dptr->data, 0, qset * sizeof(char *));
+   while (done < len && spd->nr_pages < spd->nr_pages_max) {
+      data = dptr ? srcu_dereference(dptr->data, &scull_srcu) : NULL;
+      q = data ? srcu_dereference(data[s_pos], &scull_srcu) : NULL;
+      
+      chunk = min(len - done, (size_t)(quantum - q_pos));
+      page = scull_splice_page(q, quantum, q_pos, &chunk, &offset);
+      if (!page)
+	 break;
+      spd->pages[spd->nr_pages] = page;
+      spd->partial[spd->nr_pages].offset = offset;
+      spd->partial[spd->nr_pages].len = chunk;
+      spd->nr_pages++;
+      done += chunk;
+      
+      q_pos += chunk;
+      if (q_pos < quantum)
+	 continue; /* more pages in this quantum */
+      q_pos = 0;
+      if (++s_pos == qset) {
+	 s_pos = 0;
+	 dptr = scull_lookup(dev, ++item);
+	 if (read_seqcount_retry(&dev->seq, seq))
+	    goto retry;
+      }
    }
-   if (!dptr->data[s_pos]) {
-      dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-      if (!dptr->data[s_pos])
-	 goto out;
+   return done ? done : -ENOMEM;
+}
+
+ssize_t scull_splice_read(struct file *filp, loff_t *ppos,
+			  struct pipe_inode_info *pipe, size_t len,
+			  unsigned int flags) {
+   struct scull_dev *dev = filp->private_data;
+   struct page *pages[PIPE_DEF_BUFFERS];
+   struct partial_page partial[PIPE_DEF_BUFFERS];
+   struct splice_pipe_desc spd = {
+      .pages =        pages,
+      .partial =      partial,
+      .nr_pages_max = PIPE_DEF_BUFFERS,
+      .flags =        flags,
+      .ops =          &scull_pipe_buf_ops,
+      .spd_release =  scull_spd_release,
+   };
+   ssize_t retval;
+   int idx;
+   
+   if (splice_grow_spd(pipe, &spd))
+      return -ENOMEM;
+   idx = srcu_read_lock(&scull_srcu);
+   retval = scull_splice_fill(dev, &spd, *ppos, len);
+   srcu_read_unlock(&scull_srcu, idx);
+   if (retval > 0)
+      retval = splice_to_pipe(pipe, &spd); /* drops what it can't take */
+   if (retval > 0) {
+      *ppos += retval;
+      scull_stat_add(dev, reads, 1);
+      scull_stat_add(dev, rbytes, retval);
+   }
+   splice_shrink_spd(&spd);
+   return retval;
+}
+
+/*
+ * Writing takes each pipe buffer as it comes, straight into the
+ * quanta, under a single hold of the semaphore.
+ */
+static int scull_splice_actor(struct pipe_inode_info *pipe,
+			      struct pipe_buffer *buf,
+			      struct splice_desc *sd) {
+   struct scull_dev *dev = sd->u.file->private_data;
+   char *addr;
+   int retval;
+   
+   addr = kmap(buf->page);
+   retval = scull_kernel_write(dev, addr + buf->offset, sd->len, sd->pos);
+   kunmap(buf->page);
+   return retval;
+}
+
+ssize_t scull_splice_write(struct pipe_inode_info *pipe, struct file *filp,
+			   loff_t *ppos, size_t len, unsigned int flags) {
+   struct scull_dev *dev = filp->private_data;
+   ssize_t retval;
+   
+   retval = scull_lock_io(dev, filp, NULL);
+   if (retval)
+      return retval;
+   retval = splice_from_pipe(pipe, filp, ppos, len, flags,
+			     scull_splice_actor);
+   if (retval > 0) /* splice_from_pipe leaves that to us */
+      *ppos += retval;
+   up_read(&dev->sem);
+   return retval;
+}
+
+/*
+ * Preallocation and hole punching, for writers that want no
+ * allocation at all in their way once they start.
+ */
+
+/*
+ * Make sure every quantum in [off, off + len) is there, and grow the
+ * device to cover them (like fallocate does with no flags). A range
+ * bigger than the device limit can never fit, and without a limit
+ * SCULL_PREALLOC_MAX is as much as one call takes. A fatal signal
+ * stops it with -EINTR, keeping what was done: the device grows to
+ * cover that much.
+ */
+static int scull_prealloc(struct scull_dev *dev, loff_t off, loff_t len) {
+   struct scull_qset *dptr = NULL;
+   int quantum, qset;
+   long itemsize, item;
+   int s_pos;
+   loff_t pos, end = off + len;
+   int retval = 0;
+   void *q;
+   
+   if (dev->limit && len > dev->limit)
+      return -ENOSPC;
+   if (!dev->limit && len > SCULL_PREALLOC_MAX)
+      return -EFBIG;
+   down_read(&dev->sem);
+   quantum = dev->quantum;
+   qset = dev->qset;
+   itemsize = (long)quantum * qset;
+   item = (long)off / itemsize;
+   s_pos = ((long)off % itemsize) / quantum;
+   
+   for (pos = off - off % quantum; pos < end; pos += quantum) {
+      if (fatal_signal_pending(current)) {
+	 retval = -EINTR;
+	 break;
+      }
+      cond_resched();
+      if (!dptr) {
+	 dptr = scull_follow(dev, item);
+	 if (!dptr) {
+	    retval = -ENOMEM;
+	    break;
+	 }
+	 mutex_lock(&dptr->mutex);
+      }
+      q = scull_quantum_at(dev, dptr, s_pos);
+      if (IS_ERR(q)) {
+	 retval = PTR_ERR(q);
+	 break;
+      }
+      if (++s_pos == qset) {
+	 s_pos = 0;
+	 item++;
+	 mutex_unlock(&dptr->mutex);
+	 dptr = NULL;
+      }
+   }
+   if (dptr)
+      mutex_unlock(&dptr->mutex);
+   
+   if (retval == -EINTR)
+      end = max(pos, off); /* up to where we got */
+   if (!retval || retval == -EINTR) {
+      spin_lock(&dev->lock);
+      if (dev->size < end)
+	 dev->size = end;
+      spin_unlock(&dev->lock);
+   }
+   up_read(&dev->sem);
+   return retval;
+}
+
+/*
+ * Release the quanta that [off, off + len) covers entirely, and zero
+ * the parts of the ones at the edges. The size does not change. The
+ * items themselves stay, as writers may be about to use them.
+ */
+static int scull_punch_hole(struct scull_dev *dev, loff_t off, loff_t len) {
+   struct scull_qset *dptr;
+   int quantum, qset;
+   long itemsize;
+   unsigned long item;
+   int s_pos, q_pos, found;
+   loff_t pos, end = off + len;
+   char *q;
+   int retval = 0;
+   
+   down_read(&dev->sem);
+   if (atomic_read(&dev->vmas)) { /* the pages may be mapped */
+      up_read(&dev->sem);
+      return -EBUSY;
+   }
+   quantum = dev->quantum;
+   qset = dev->qset;
+   itemsize = (long)quantum * qset;
+   item = (long)off / itemsize;
+   
+   for (;;) {
+      /* skip straight to the next item that exists */
+      rcu_read_lock();
+      found = radix_tree_gang_lookup(&dev->index, (void **) &dptr, item, 1);
+      rcu_read_unlock();
+      if (!found || (loff_t)dptr->item * itemsize >= end)
+	 break;
+      item = dptr->item;
+      
+      mutex_lock(&dptr->mutex);
+      dptr->dirty = 1; /* for a relayout under way */
+      if (dptr->shared)
+	 retval = scull_unshare(dev, dptr);
+      for (s_pos = 0; !retval && dptr->data && s_pos < qset; s_pos++) {
+	 pos = (loff_t)item * itemsize + (loff_t)s_pos * quantum;
+	 if (pos + quantum <= off || pos >= end || !dptr->data[s_pos])
+	    continue;
+	 q = dptr->data[s_pos];
+	 if (pos >= off && pos + quantum <= end) { /* all of it */
+	    rcu_assign_pointer(dptr->data[s_pos], NULL);
+	    scull_retire_quantum(q, quantum);
+	    atomic_long_sub(quantum, &dev->used);
+	    continue;
+	 }
+	 q = scull_quantum_at(dev, dptr, s_pos); /* if compressed */
+	 if (IS_ERR(q)) {
+	    retval = PTR_ERR(q);
+	    break;
+	 }
+	 q_pos = pos < off ? off - pos : 0;
+	 memset(q + q_pos, 0, min(end - pos, (loff_t)quantum) - q_pos);
+      }
+      mutex_unlock(&dptr->mutex);
+      if (retval)
+	 break;
+      item++;
+   }
+   up_read(&dev->sem);
+   return retval;
+}
+
+/*
+ * Per-device geometry. Changing it on a device that holds data means
+ * copying everything into a new index laid out the new way; that is
+ * done from the workqueue, while the device goes on being used. The
+ * copy is made with the semaphore shared, let go of between items;
+ * writers mark what they change meanwhile (dptr->dirty), and that is
+ * copied again. Only the last round, over whatever is still dirty,
+ * holds writers off -- readers keep seeing the old layout until the
+ * switch. One relayout at a time, as the dirty marks are shared.
+ */
+struct scull_relayout {
+   struct work_struct work;
+   struct scull_dev *dev;
+   int quantum, qset;
+};
+
+static DEFINE_MUTEX(scull_relayout_mutex);
+
+/*
+ * Put len bytes at pos in tmp, which is all ours: from q, or zeroes
+ * if q is NULL (a hole now, that may not have been one at the last
+ * copy). Holes stay holes: zeroes are only written over quanta that
+ * are there already.
+ */
+static int scull_layout_put(struct scull_dev *tmp, loff_t pos, char *q,
+			    size_t len) {
+   struct scull_qset *nptr;
+   long nitemsize = (long)tmp->quantum * tmp->qset;
+   int ns_pos, nq_pos;
+   size_t chunk;
+   char *nq;
+   
+   while (len) {
+      ns_pos = ((long)pos % nitemsize) / tmp->quantum;
+      nq_pos = ((long)pos % nitemsize) % tmp->quantum;
+      chunk = min(len, (size_t)(tmp->quantum - nq_pos));
+      if (q) {
+	 nptr = scull_follow(tmp, (long)pos / nitemsize);
+	 if (!nptr)
+	    return -ENOMEM;
+	 nq = scull_quantum_at(tmp, nptr, ns_pos);
+	 if (IS_ERR(nq))
+	    return PTR_ERR(nq);
+	 memcpy(nq + nq_pos, q, chunk);
+	 q += chunk;
+      } else {
+	 nptr = scull_lookup(tmp, (long)pos / nitemsize);
+	 if (nptr && nptr->data && nptr->data[ns_pos])
+	    memset(nptr->data[ns_pos] + nq_pos, 0, chunk);
+      }
+      pos += chunk;
+      len -= chunk;
+   }
+   return 0;
+}
+
+/*
+ * Copy one item of dev into tmp, with its mutex held. Whole quanta
+ * go, whatever the size says: a writer may have written past it,
+ * and not yet got to growing it.
+ */
+static int scull_copy_item(struct scull_dev *dev, struct scull_dev *tmp,
+			   struct scull_qset *dptr) {
+   long itemsize = (long)dev->quantum * dev->qset;
+   loff_t pos;
+   int s_pos, retval = 0;
+   char *q;
+   
+   for (s_pos = 0; s_pos < dev->qset && !retval; s_pos++) {
+      pos = (loff_t)dptr->item * itemsize + (loff_t)s_pos * dev->quantum;
+      q = dptr->data ? dptr->data[s_pos] : NULL;
+      if (q && (SCULL_ZQUANTUM(q) || SCULL_SQUANTUM(q))) {
+	 q = scull_quantum_at(dev, dptr, s_pos);
+	 if (IS_ERR(q))
+	    return PTR_ERR(q);
+      }
+      retval = scull_layout_put(tmp, pos, q, dev->quantum);
+      cond_resched();
+   }
+   if (!retval)
+      dptr->dirty = 0;
+   return retval;
+}
+
+/*
+ * One round of copying dev into tmp: every item, or only the dirty
+ * ones. With the semaphore held shared (excl == 0), it is let go of
+ * after each item; -EAGAIN if the index was replaced meanwhile (a
+ * trim), -EBUSY if the device was mapped, as stores through a
+ * mapping don't mark anything.
+ */
+static int scull_copy_layout(struct scull_dev *dev, struct scull_dev *tmp,
+			     unsigned seq, unsigned long maps, int all,
+			     int excl) {
+   struct scull_qset *dptr;
+   unsigned long item = 0;
+   int retval;
+   
+   while (radix_tree_gang_lookup(&dev->index, (void **) &dptr, item, 1)) {
+      item = dptr->item + 1;
+      mutex_lock(&dptr->mutex);
+      retval = all || dptr->dirty ? scull_copy_item(dev, tmp, dptr) : 0;
+      mutex_unlock(&dptr->mutex);
+      if (retval)
+	 return retval;
+      if (excl)
+	 continue;
+      up_read(&dev->sem);
+      cond_resched();
+      down_read(&dev->sem);
+      if (read_seqcount_retry(&dev->seq, seq))
+	 return -EAGAIN;
+      if (atomic_read(&dev->vmas) || dev->maps != maps)
+	 return -EBUSY;
+   }
+   return 0;
+}
+
+/*
+ * Make snap a copy of dev that shares all of its arrays, and so its
+ * quanta: only the items are new, and one reference per array is all
+ * it costs. The first write to an item of dev gives it an array of
+ * its own (scull_unshare). Must be called with dev's semaphore held
+ * for writing, which keeps its writers and compression away; snap is
+ * empty and nobody else uses it yet.
+ */
+int scull_share_index(struct scull_dev *dev, struct scull_dev *snap) {
+   struct scull_qset *dptr, *nptr;
+   struct scull_sarray *sa;
+   unsigned long item = 0;
+   
+   while (radix_tree_gang_lookup(&dev->index, (void **) &dptr, item, 1)) {
+      item = dptr->item + 1;
+      if (!dptr->data)
+	 continue;
+      nptr = scull_follow(snap, dptr->item);
+      if (!nptr)
+	 return -ENOMEM;
+      sa = dptr->shared;
+      if (!sa) { /* the first snapshot of this item */
+	 sa = kmalloc(sizeof(*sa), GFP_KERNEL);
+	 if (!sa)
+	    return -ENOMEM;
+	 atomic_set(&sa->refs, 1);
+	 sa->data = dptr->data;
+	 sa->quantum = dev->quantum;
+	 sa->qset = dev->qset;
+	 dptr->shared = sa;
+      }
+      atomic_inc(&sa->refs);
+      nptr->shared = sa;
+      nptr->data = sa->data;
    }
-   /* write only up to the end of this quantum */
-   if (count > quantum - q_pos)
-      count = quantum - q_pos;
+   snap->size = dev->size;
+   atomic_long_set(&snap->used, atomic_long_read(&dev->used));
+   return 0;
+}
+
+static void scull_relayout_work(struct work_struct *work) {
+   struct scull_relayout *r = container_of(work, struct scull_relayout, work);
+   struct scull_dev *dev = r->dev, *tmp;
+   struct radix_tree_root old;
+   unsigned long maps;
+   int quantum, qset, retval;
+   unsigned seq;
+   long bytes;
    
-   if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-      retval = -EFAULT;
+   tmp = kzalloc(sizeof(*tmp), GFP_KERNEL);
+   if (!tmp)
       goto out;
+   scull_init_dev(tmp);
+   tmp->limit = 0; /* the data is there already: it must fit */
+   tmp->node = ACCESS_ONCE(dev->node);
+   tmp->quantum = r->quantum;
+   tmp->qset = r->qset;
+   mutex_lock(&scull_relayout_mutex);
+   
+ again:
+   down_read(&dev->sem);
+   if (atomic_read(&dev->vmas) ||
+       (dev->quantum == r->quantum && dev->qset == r->qset)) {
+      up_read(&dev->sem);
+      goto unlock; /* mapped meanwhile, or nothing to do */
    }
-   *f_pos += count;
-   retval = count;
+   seq = read_seqcount_begin(&dev->seq); /* no trim can be under way */
+   maps = dev->maps;
+   retval = scull_copy_layout(dev, tmp, seq, maps, 1, 0);
+   if (!retval) /* what the writers changed meanwhile */
+      retval = scull_copy_layout(dev, tmp, seq, maps, 0, 0);
+   up_read(&dev->sem);
    
-   /* update the size */
-   if (dev->size < *f_pos)
-      dev->size = *f_pos;
+   if (!retval) {
+      down_write(&dev->sem);
+      if (read_seqcount_retry(&dev->seq, seq))
+	 retval = -EAGAIN;
+      else if (atomic_read(&dev->vmas) || dev->maps != maps)
+	 retval = -EBUSY;
+      else /* the last of it, holding writers off */
+	 retval = scull_copy_layout(dev, tmp, seq, maps, 0, 1);
+      if (!retval)
+	 goto swap;
+      up_write(&dev->sem);
+   }
+   scull_free_items(&tmp->index, tmp->quantum, tmp->qset);
+   atomic_long_set(&tmp->used, 0);
+   if (retval == -EAGAIN)
+      goto again; /* trimmed: start over with what is left */
+   goto unlock; /* mapped, or no memory: keep the old layout */
+   
+ swap:
+   quantum = dev->quantum;
+   qset = dev->qset;
+   write_seqcount_begin(&dev->seq);
+   old = dev->index;
+   dev->index = tmp->index;
+   dev->quantum = r->quantum;
+   dev->qset = r->qset;
+   write_seqcount_end(&dev->seq);
+   bytes = atomic_long_xchg(&dev->used, atomic_long_read(&tmp->used));
+   scull_retire_index(dev, &old, quantum, qset, bytes);
+   up_write(&dev->sem);
    
+ unlock:
+   mutex_unlock(&scull_relayout_mutex);
+   kfree(tmp);
  out:
-   up(&dev->sem);
+   kfree(r);
+}
+
+/*
+ * A geometry a device can take. The offsets within an item (quantum *
+ * qset bytes) are ints all along the I/O paths, so an item must fit.
+ */
+int scull_geometry_valid(int quantum, int qset) {
+   return quantum > 0 && qset > 0 && quantum <= KMALLOC_MAX_SIZE &&
+      qset <= KMALLOC_MAX_SIZE / sizeof(void *) &&
+      (u64)quantum * qset <= INT_MAX;
+}
+
+static int scull_set_geometry(struct scull_dev *dev, int quantum, int qset) {
+   struct scull_relayout *r;
+   struct scull_qset *dptr;
+   int retval = 0;
+   
+   if (!scull_geometry_valid(quantum, qset))
+      return -EINVAL;
+   
+   down_write(&dev->sem);
+   if (atomic_read(&dev->vmas)) { /* the pages are in use as they are */
+      retval = -EBUSY;
+      goto out;
+   }
+   dev->own_geometry = 1;
+   if (!radix_tree_gang_lookup(&dev->index, (void **) &dptr, 0, 1)) {
+      /* empty: nothing to move, the new geometry applies right away */
+      write_seqcount_begin(&dev->seq);
+      dev->quantum = quantum;
+      dev->qset = qset;
+      write_seqcount_end(&dev->seq);
+      goto out;
+   }
+   
+   r = scull_wq ? kmalloc(sizeof(*r), GFP_KERNEL) : NULL;
+   if (!r) {
+      retval = -ENOMEM;
+      goto out;
+   }
+   INIT_WORK(&r->work, scull_relayout_work);
+   r->dev = dev;
+   r->quantum = quantum;
+   r->qset = qset;
+   queue_work(scull_wq, &r->work);
+ out:
+   up_write(&dev->sem);
    return retval;
 }
 
+/*
+ * Batches: many commands in one system call, all of them under a
+ * single hold of the semaphore -- but trims, which get it exclusive
+ * for as long as they need it.
+ */
+static void scull_run_cmd(struct file *filp, struct scull_dev *dev,
+			  struct scull_cmd *cmd) {
+   char __user *buf = (char __user *)(unsigned long) cmd->addr;
+   loff_t pos = cmd->offset;
+   int idx;
+   
+   if (pos < 0 || (loff_t)(pos + cmd->len) < 0) {
+      cmd->result = -EINVAL;
+      return;
+   }
+   switch (cmd->op) {
+   case SCULL_CMD_READ:
+      if (!(filp->f_mode & FMODE_READ)) {
+	 cmd->result = -EBADF;
+	 break;
+      }
+      up_read(&dev->sem); /* readers don't need it, and may fault */
+      idx = srcu_read_lock(&scull_srcu);
+      cmd->result = scull_do_read(dev, buf, cmd->len, &pos);
+      srcu_read_unlock(&scull_srcu, idx);
+      down_read(&dev->sem);
+      break;
+      
+   case SCULL_CMD_WRITE:
+      if (!(filp->f_mode & FMODE_WRITE)) {
+	 cmd->result = -EBADF;
+	 break;
+      }
+      cmd->result = scull_do_write(dev, buf, cmd->len, &pos,
+				   scull_nowait(filp, NULL));
+      break;
+      
+   case SCULL_CMD_QUANTUM:
+      cmd->result = dev->quantum;
+      break;
+      
+   case SCULL_CMD_QSET:
+      cmd->result = dev->qset;
+      break;
+      
+   case SCULL_CMD_TRIM:
+      if (!(filp->f_mode & FMODE_WRITE)) {
+	 cmd->result = -EBADF;
+	 break;
+      }
+      up_read(&dev->sem);
+      down_write(&dev->sem);
+      cmd->result = scull_trim(dev);
+      downgrade_write(&dev->sem); /* and on with the batch */
+      break;
+      
+   default:
+      cmd->result = -EINVAL;
+   }
+}
+
+static long scull_run_batch(struct file *filp, struct scull_dev *dev,
+			    struct scull_batch __user *ubatch) {
+   struct scull_batch batch;
+   struct scull_cmd cmds[16], __user *ucmds;
+   unsigned int i, n, done = 0;
+   long retval;
+   
+   if (copy_from_user(&batch, ubatch, sizeof(batch)))
+      return -EFAULT;
+   ucmds = (struct scull_cmd __user *)(unsigned long) batch.cmds;
+   
+   retval = 0;
+   while (done < batch.count) { /* a few at a time, on the stack */
+      n = min_t(unsigned int, batch.count - done, ARRAY_SIZE(cmds));
+      if (copy_from_user(cmds, ucmds + done, n * sizeof(cmds[0]))) {
+	 retval = -EFAULT;
+	 break;
+      }
+      /* The cmds may live in a mapping of dev: copy them unlocked */
+      retval = scull_lock_io(dev, filp, NULL);
+      if (retval)
+	 break;
+      for (i = 0; i < n; i++)
+	 scull_run_cmd(filp, dev, cmds + i);
+      up_read(&dev->sem);
+      if (copy_to_user(ucmds + done, cmds, n * sizeof(cmds[0]))) {
+	 retval = -EFAULT;
+	 break;
+      }
+      done += n;
+   }
+   
+   if (put_user(done, &ubatch->done))
+      return -EFAULT;
+   return done ? done : retval;
+}
+
+/*
+ * Tell the bare devices from the pipes, which share our ioctl method.
+ */
+static struct scull_dev *scull_ioctl_dev(struct file *filp) {
+   if (filp->f_op->read != scull_read)
+      return NULL;
+   return filp->private_data;
+}
+
 /*
  * The ioctl() implementation
  */
@@ -366,6 +1996,11 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
    
    int err = 0, tmp;
    int retval = 0;
+   struct scull_dev *dev;
+   struct scull_range range;
+   struct scull_geometry geom;
+   __u64 limit;
+   int node;
    
    /*
     * extract the type and number bitfields, and don't decode
@@ -464,18 +2099,154 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
       return tmp;
       
       /*
-       * The following two change the buffer size for scullpipe.
-       * The scullpipe device uses this same ioctl method, just to
-       * write less code. Actually, it's the same driver, isn't it?
+       * The following change the buffer size for scullpipe: the
+       * default one, then the one of an open pipe. The scullpipe
+       * device uses this same ioctl method, just to write less code.
+       * Actually, it's the same driver, isn't it?
        */
       
-   case SCULL_P_IOCTSIZE:
+   case SCULL_P_IOCTSIZE: /* bounded as scull_p_resize does */
+      if ((long)arg <= 0 || arg > SCULL_P_MAX_RING)
+	 return -EINVAL;
+      if ((long)roundup_pow_of_two(arg) > scull_p_max_buffer &&
+	  ! capable (CAP_SYS_RESOURCE))
+	 return -EPERM; /* the ring it gets is what counts */
       scull_p_buffer = arg;
       break;
       
    case SCULL_P_IOCQSIZE:
       return scull_p_buffer;
       
+   case SCULL_P_IOCTRING:
+      return scull_p_resize(filp, arg);
+      
+   case SCULL_P_IOCQRING:
+      return scull_p_get_ring(filp);
+      
+      /*
+       * Preallocation and hole punching work on one bare device.
+       */
+   case SCULL_IOCPREALLOC:
+   case SCULL_IOCPUNCH:
+      dev = scull_ioctl_dev(filp);
+      if (!dev)
+	 return -ENOTTY;
+      if (!(filp->f_mode & FMODE_WRITE))
+	 return -EBADF;
+      if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+	 return -EFAULT;
+      if ((loff_t)range.offset < 0 || (loff_t)range.length <= 0 ||
+	  (loff_t)(range.offset + range.length) < 0)
+	 return -EINVAL;
+      if (cmd == SCULL_IOCPREALLOC)
+	 return scull_prealloc(dev, range.offset, range.length);
+      return scull_punch_hole(dev, range.offset, range.length);
+      
+      /*
+       * The geometry of one bare device, as opposed to the default.
+       */
+   case SCULL_IOCSGEOMETRY:
+      dev = scull_ioctl_dev(filp);
+      if (!dev)
+	 return -ENOTTY;
+      if (!(filp->f_mode & FMODE_WRITE))
+	 return -EBADF;
+      if (copy_from_user(&geom, (void __user *)arg, sizeof(geom)))
+	 return -EFAULT;
+      if (geom.quantum < (int)SCULL_MIN_QUANTUM && ! capable (CAP_SYS_ADMIN))
+	 return -EPERM;
+      return scull_set_geometry(dev, geom.quantum, geom.qset);
+      
+   case SCULL_IOCGGEOMETRY:
+      dev = scull_ioctl_dev(filp);
+      if (!dev)
+	 return -ENOTTY;
+      down_read(&dev->sem);
+      geom.quantum = dev->quantum;
+      geom.qset = dev->qset;
+      up_read(&dev->sem);
+      if (copy_to_user((void __user *)arg, &geom, sizeof(geom)))
+	 return -EFAULT;
+      return 0;
+      
+   case SCULL_IOCSLIMIT: /* the bytes of quanta a device may hold */
+      dev = scull_ioctl_dev(filp);
+      if (!dev)
+	 return -ENOTTY;
+      if (! capable (CAP_SYS_ADMIN))
+	 return -EPERM;
+      if (copy_from_user(&limit, (void __user *)arg, sizeof(limit)))
+	 return -EFAULT;
+      if (limit > LONG_MAX)
+	 return -EINVAL;
+      dev->limit = limit; /* what is there already stays */
+      return 0;
+      
+   case SCULL_IOCGLIMIT:
+      dev = scull_ioctl_dev(filp);
+      if (!dev)
+	 return -ENOTTY;
+      limit = dev->limit;
+      if (copy_to_user((void __user *)arg, &limit, sizeof(limit)))
+	 return -EFAULT;
+      return 0;
+      
+   case SCULL_IOCTSNAPSHOT:
+      dev = scull_ioctl_dev(filp);
+      if (!dev)
+	 return -ENOTTY;
+      if (! capable (CAP_SYS_ADMIN))
+	 return -EPERM;
+      return scull_snapshot(dev);
+      
+   case SCULL_IOCTSNAPDROP:
+      if (! capable (CAP_SYS_ADMIN))
+	 return -EPERM;
+      return scull_snap_drop(arg);
+      
+   case SCULL_IOCSAVE:
+      if (! capable (CAP_SYS_ADMIN))
+	 return -EPERM;
+      return scull_persist_save();
+      
+      /*
+       * The node a device (bare or pipe) takes its memory from, from
+       * now on: what it holds already stays where it is.
+       */
+   case SCULL_IOCSNODE:
+      if (! capable (CAP_SYS_ADMIN))
+	 return -EPERM;
+      retval = __get_user(node, (int __user *)arg);
+      if (retval)
+	 return retval;
+      if (!scull_node_valid(node))
+	 return -EINVAL;
+      dev = scull_ioctl_dev(filp);
+      if (dev)
+	 dev->node = node;
+      else
+	 scull_p_set_node(filp, node);
+      return 0;
+      
+   case SCULL_IOCGNODE:
+      dev = scull_ioctl_dev(filp);
+      node = dev ? dev->node : scull_p_get_node(filp);
+      return __put_user(node, (int __user *)arg);
+      
+   case SCULL_IOCBATCH:
+      dev = scull_ioctl_dev(filp);
+      if (!dev)
+	 return -ENOTTY;
+      return scull_run_batch(filp, dev, (struct scull_batch __user *)arg);
+      
+   case SCULL_IOCWTRIM: /* wait for earlier trims to give memory back */
+      dev = scull_ioctl_dev(filp);
+      if (!dev)
+	 return -ENOTTY;
+      if (wait_event_interruptible(dev->trimq,
+				   atomic_long_read(&dev->trimming) == 0))
+	 return -ERESTARTSYS;
+      return 0;
       
    default:  /* redundant, as cmd was checked against MAXNR */
       return -ENOTTY;
@@ -488,6 +2259,59 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
  * The "extended" operations -- only seek
  */
 
+/*
+ * Find the first offset at or after off that holds data (data != 0)
+ * or lies in a hole (data == 0), a quantum at a time. Missing items
+ * are skipped over with a single index lookup. Must be called with
+ * the device semaphore held.
+ */
+static loff_t scull_seek_hole_data(struct scull_dev *dev, loff_t off,
+				   int data) {
+   struct scull_qset *dptr;
+   int quantum = dev->quantum, qset = dev->qset;
+   long itemsize = (long)quantum * qset;
+   unsigned long item;
+   int s_pos, found;
+   loff_t pos;
+   
+   if (off < 0 || off >= dev->size)
+      return -ENXIO;
+   item = (long)off / itemsize;
+   s_pos = ((long)off % itemsize) / quantum;
+   
+   for (;;) {
+      pos = (loff_t)item * itemsize + (loff_t)s_pos * quantum;
+      if (pos >= dev->size)
+	 break;
+      
+      /* the first item there is at or after this one */
+      rcu_read_lock();
+      found = radix_tree_gang_lookup(&dev->index, (void **) &dptr, item, 1);
+      rcu_read_unlock();
+      
+      if (!found || dptr->item != item) { /* a whole item is missing */
+	 if (!data)
+	    return max(pos, off);
+	 if (!found)
+	    break;
+	 item = dptr->item;
+	 s_pos = 0;
+	 continue;
+      }
+      for (; s_pos < qset; s_pos++) {
+	 pos = (loff_t)item * itemsize + (loff_t)s_pos * quantum;
+	 if (pos >= dev->size)
+	    break;
+	 if ((dptr->data && dptr->data[s_pos]) == !!data)
+	    return max(pos, off);
+      }
+      item++;
+      s_pos = 0;
+   }
+   /* end of file: it counts as a hole, but there is no more data */
+   return data ? -ENXIO : dev->size;
+}
+
 loff_t scull_llseek(struct file *filp, loff_t off, int whence) {
    struct scull_dev *dev = filp->private_data;
    loff_t newpos;
@@ -505,6 +2329,15 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence) {
       newpos = dev->size + off;
       break;
       
+   case 3: /* SEEK_DATA */
+   case 4: /* SEEK_HOLE */
+      down_read(&dev->sem);
+      newpos = scull_seek_hole_data(dev, off, whence == 3);
+      up_read(&dev->sem);
+      if (newpos < 0)
+	 return newpos;
+      break;
+      
    default: /* can't happen */
       return -EINVAL;
    }
@@ -518,7 +2351,12 @@ struct file_operations scull_fops = {
    .llseek =   scull_llseek,
    .read =     scull_read,
    .write =    scull_write,
+   .aio_read = scull_aio_read,
+   .aio_write = scull_aio_write,
+   .splice_read = scull_splice_read,
+   .splice_write = scull_splice_write,
    .unlocked_ioctl = scull_ioctl,
+   .mmap =     scull_mmap,
    .open =     scull_open,
    .release =  scull_release,
 };
@@ -536,12 +2374,18 @@ void scull_cleanup_module(void) {
    int i;
    dev_t devno = MKDEV(scull_major, scull_minor);
    
+   scull_persist_cleanup(); /* while compressed quanta can be read */
+   scull_compress_cleanup();
+   debugfs_remove_recursive(scull_debugfs);
+   
    /* Get rid of our char dev entries */
    if (scull_devices) {
       for (i = 0; i < scull_nr_devs; i++) {
 	 scull_trim(scull_devices + i);
 	 cdev_del(&scull_devices[i].cdev);
+	 free_percpu(scull_devices[i].stats);
       }
+      scull_flush_work(); /* they still point to the devices */
       kfree(scull_devices);
    }
    
@@ -555,7 +2399,14 @@ void scull_cleanup_module(void) {
    /* and call the cleanup functions for friend devices */
    scull_p_cleanup();
    scull_access_cleanup();
+   scull_snap_cleanup();
    
+   /* only now that every device is empty */
+   if (scull_wq)
+      destroy_workqueue(scull_wq);
+   srcu_barrier(&scull_srcu); /* quanta still waiting to be freed */
+   scull_destroy_caches();
+   cleanup_srcu_struct(&scull_srcu);
 }
 
 /*
@@ -594,11 +2445,33 @@ int scull_init_module(void) {
       return result;
    }
    
+   result = init_srcu_struct(&scull_srcu);
+   if (result) {
+      unregister_chrdev_region(dev, scull_nr_devs);
+      return result;
+   }
+   
+   /* the caches and pools behind the storage of every device */
+   if (!scull_node_valid(scull_node)) {
+      printk(KERN_WARNING "scull: no node %i, using the local one\n",
+	     scull_node);
+      scull_node = SCULL_NODE_LOCAL;
+   }
+   if (scull_huge)
+      scull_quantum = SCULL_HUGE_QUANTUM;
+   result = scull_create_caches();
+   if (result)
+      goto fail;
+   /* without it, trims are done synchronously and relayouts refused */
+   scull_wq = alloc_workqueue("scull", WQ_UNBOUND, 0);
+   
    /* 
     * allocate the devices -- we can't have them static, as the number
     * can be specified at load time
     */
-   scull_devices = kmalloc(scull_nr_devs*sizeof(struct scull_dev), GFP_KERNEL);
+   scull_devices = kmalloc_node(scull_nr_devs*sizeof(struct scull_dev),
+				GFP_KERNEL, scull_node >= 0 ? scull_node :
+				NUMA_NO_NODE);
    if (!scull_devices) {
       result = -ENOMEM;
       goto fail;  /* Make this more graceful */
@@ -607,9 +2480,9 @@ int scull_init_module(void) {
    
    /* Initialize each device. */
    for (i = 0; i < scull_nr_devs; i++) {
-      scull_devices[i].quantum = scull_quantum;
-      scull_devices[i].qset = scull_qset;
-      sema_init(&scull_devices[i].sem, 1);
+      scull_init_dev(&scull_devices[i]);
+      /* not fatal either: the device just counts nothing */
+      scull_devices[i].stats = alloc_percpu(struct scull_stats);
       scull_setup_cdev(&scull_devices[i], i);
    }
    
@@ -617,11 +2490,20 @@ int scull_init_module(void) {
    dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
    dev += scull_p_init(dev);
    dev += scull_access_init(dev);
+   dev += scull_snap_init(dev);
    
 #ifdef SCULL_DEBUG /* only when debugging */
    scull_create_proc();
 #endif
    
+   /* what was saved at the last unload, if anything; not fatal */
+   scull_persist_restore();
+   
+   /* cold quanta are compressed from now on, if so asked */
+   scull_debugfs = debugfs_create_dir("scull", NULL);
+   scull_stats_init();
+   scull_compress_init();
+   
    return 0; /* succeed */
    
  fail:
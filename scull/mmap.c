@@ -0,0 +1,135 @@
+/*
+ * mmap.c -- memory mapping for the bare scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>       /* printk() */
+#include <linux/mm.h>           /* everything */
+#include <linux/fs.h>
+#include <linux/errno.h>        /* error codes */
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/radix-tree.h>
+#include <linux/err.h>
+#include <linux/percpu.h>
+#include <asm/atomic.h>
+
+#include "scull.h"              /* local definitions */
+
+/*
+ * open and close: just keep track of how many times the device is
+ * mapped, to avoid releasing it.
+ */
+static void scull_vma_open(struct vm_area_struct *vma) {
+   struct scull_dev *dev = vma->vm_private_data;
+
+   atomic_inc(&dev->vmas);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma) {
+   struct scull_dev *dev = vma->vm_private_data;
+
+   atomic_dec(&dev->vmas);
+}
+
+/*
+ * The fault method: look up the quantum backing this page and hand
+ * its page to the mm layer. Holes inside the device are filled, so
+ * stores through the mapping have somewhere to go; anything past the
+ * end of the device gets SIGBUS. We take the semaphore and the item
+ * mutex here, so nobody may touch user memory with either held: a
+ * write from a mapping of the same device would fault into us.
+ */
+static int scull_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf) {
+   struct scull_dev *dev = vma->vm_private_data;
+   unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+   struct scull_qset *dptr;
+   long itemsize, item;
+   int s_pos, q_pos, rest;
+   char *q;
+   int retval = VM_FAULT_SIGBUS;
+
+   down_read(&dev->sem);
+   if (offset >= dev->size) goto out; /* out of range */
+   if (!scull_quantum_paged(dev->quantum))
+      goto out; /* can't be, see scull_mmap: but never map a slab */
+
+   /* find listitem, qset index and offset in the quantum */
+   itemsize = (long)dev->quantum * dev->qset;
+   item = (long)offset / itemsize;
+   rest = (long)offset % itemsize;
+   s_pos = rest / dev->quantum; q_pos = rest % dev->quantum;
+
+   dptr = scull_follow(dev, item);
+   if (!dptr) {
+      scull_stat_add(dev, nomem, 1);
+      retval = VM_FAULT_OOM;
+      goto out;
+   }
+   mutex_lock(&dptr->mutex);
+   q = scull_quantum_at(dev, dptr, s_pos);
+   mutex_unlock(&dptr->mutex);
+   if (IS_ERR(q)) { /* over the device limit is not the system's OOM */
+      retval = PTR_ERR(q) == -ENOSPC ? VM_FAULT_SIGBUS : VM_FAULT_OOM;
+      if (retval == VM_FAULT_OOM)
+	 scull_stat_add(dev, nomem, 1);
+      goto out;
+   }
+   /*
+    * got it, now increment the count. Within a compound huge quantum
+    * this is a tail page, whose count is kept by the head page:
+    * get_page knows. A vmalloc'ed one is small pages to begin with.
+    * The mapping is made of small page-table entries either way.
+    */
+   vmf->page = scull_quantum_page(q + q_pos);
+   get_page(vmf->page);
+   retval = 0;
+
+ out:
+   up_read(&dev->sem);
+   return retval;
+}
+
+static struct vm_operations_struct scull_vm_ops = {
+   .open =     scull_vma_open,
+   .close =    scull_vma_close,
+   .fault =    scull_vma_fault,
+};
+
+/*
+ * The geometry may only change while the device is not mapped (see
+ * scull_set_geometry), so the check and the count go together, under
+ * the semaphore that the geometry changes under.
+ */
+int scull_mmap(struct file *filp, struct vm_area_struct *vma) {
+   struct scull_dev *dev = filp->private_data;
+
+   down_write(&dev->sem);
+   /* refuse to map if the quanta are not made of whole pages */
+   if (!scull_quantum_paged(dev->quantum)) {
+      up_write(&dev->sem);
+      return -ENODEV;
+   }
+
+   /* don't do anything here: "fault" will set up page table entries */
+   vma->vm_ops = &scull_vm_ops;
+   vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+   vma->vm_private_data = dev;
+   scull_vma_open(vma);
+   dev->maps++; /* for a relayout under way, see main.c */
+   up_write(&dev->sem);
+   return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * persist.c -- saving the bare devices to a file, and back
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>       /* printk() */
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/namei.h>        /* lookup_one_len(), lock_rename() */
+#include <linux/mount.h>        /* mnt_want_write() */
+#include <linux/slab.h>
+#include <linux/string.h>       /* kbasename() */
+#include <linux/errno.h>        /* error codes */
+#include <linux/fcntl.h>        /* O_CREAT and friends */
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/radix-tree.h>
+#include <asm/uaccess.h>        /* set_fs() */
+
+#include "scull.h"              /* local definitions */
+
+/*
+ * If scull_backing names a file, the bare devices are saved to it on
+ * unload (or on demand, SCULL_IOCSAVE) and restored from it on load.
+ * The file holds, for each device, its geometry and size followed by
+ * its extents: runs of quanta that are not holes, each one a header
+ * and the data. A zero-length extent ends the device, so an empty one
+ * is just that. Everything goes by in chunks of SCULL_PERSIST_CHUNK.
+ * A save goes to scull_backing.tmp first, and is renamed over the old
+ * image only once it is all on disk.
+ */
+static char *scull_backing = NULL;
+module_param(scull_backing, charp, S_IRUGO);
+
+#define SCULL_PERSIST_MAGIC   0x4c4c5553 /* "SULL" */
+#define SCULL_PERSIST_VERSION 1
+#define SCULL_PERSIST_CHUNK   (1024 * 1024)
+
+struct scull_persist_header {
+   __u32 magic;
+   __u32 version;
+   __u32 nr_devs;            /* device records that follow */
+   __u32 reserved;
+};
+
+struct scull_persist_dev {
+   __u32 index;              /* which scull device */
+   __s32 quantum;
+   __s32 qset;
+   __u32 reserved;
+   __u64 size;
+};
+
+struct scull_persist_extent {
+   __u64 offset;
+   __u64 length;             /* followed by as many bytes */
+};
+
+/*
+ * Don't write over a backing file we could not read: only once it has
+ * been restored (or was not there) are the devices worth saving.
+ */
+static int scull_persist_ready;
+
+static int scull_persist_io(struct file *f, void *buf, size_t len,
+			    loff_t *pos, int write) {
+   mm_segment_t old_fs = get_fs();
+   ssize_t result = 0;
+   size_t done = 0;
+
+   set_fs(KERNEL_DS); /* vfs_read and vfs_write want user buffers */
+   while (done < len) {
+      if (write)
+	 result = vfs_write(f, (const char __user *)buf + done,
+			    len - done, pos);
+      else
+	 result = vfs_read(f, (char __user *)buf + done, len - done, pos);
+      if (result <= 0)
+	 break;
+      done += result;
+   }
+   set_fs(old_fs);
+   if (result < 0)
+      return result;
+   return done == len ? 0 : -EIO; /* short file, or full disk */
+}
+
+/*
+ * Chunks are big enough for any quantum.
+ */
+static char *scull_persist_buffer(int quantum, size_t *size) {
+   *size = max_t(size_t, SCULL_PERSIST_CHUNK, quantum);
+   return vmalloc(*size);
+}
+
+static int scull_save_extent(struct file *f, loff_t *fpos, loff_t start,
+			     char *buf, size_t len) {
+   struct scull_persist_extent ext;
+   int retval;
+
+   ext.offset = start;
+   ext.length = len;
+   retval = scull_persist_io(f, &ext, sizeof(ext), fpos, 1);
+   if (!retval && len)
+      retval = scull_persist_io(f, buf, len, fpos, 1);
+   return retval;
+}
+
+/*
+ * Save one device, with its semaphore held for writing: writers wait,
+ * so what is saved is what the device held at one point in time.
+ */
+static int scull_save_dev(struct file *f, loff_t *fpos,
+			  struct scull_dev *dev, int index) {
+   struct scull_persist_dev rec;
+   struct scull_qset *dptr;
+   unsigned long item = 0;
+   long itemsize;
+   loff_t pos, start = 0;
+   size_t len, fill = 0, bufsize;
+   int s_pos, retval;
+   char *buf;
+
+   buf = scull_persist_buffer(dev->quantum, &bufsize);
+   if (!buf)
+      return -ENOMEM;
+   rec.index = index;
+   rec.quantum = dev->quantum;
+   rec.qset = dev->qset;
+   rec.reserved = 0;
+   rec.size = dev->size;
+   retval = scull_persist_io(f, &rec, sizeof(rec), fpos, 1);
+   itemsize = (long)dev->quantum * dev->qset;
+
+   while (!retval &&
+	  radix_tree_gang_lookup(&dev->index, (void **) &dptr, item, 1)) {
+      item = dptr->item + 1;
+      for (s_pos = 0; dptr->data && s_pos < dev->qset; s_pos++) {
+	 pos = (loff_t)dptr->item * itemsize + (loff_t)s_pos * dev->quantum;
+	 if (!dptr->data[s_pos] || pos >= dev->size)
+	    continue;
+	 len = min_t(loff_t, dev->quantum, dev->size - pos);
+	 /* a hole in between, or the chunk is full: out with it */
+	 if (fill && (start + fill != pos || fill + len > bufsize)) {
+	    retval = scull_save_extent(f, fpos, start, buf, fill);
+	    if (retval)
+	       break;
+	    fill = 0;
+	 }
+	 if (!fill)
+	    start = pos;
+	 if (scull_kernel_read(dev, buf + fill, len, pos) != len) {
+	    retval = -EIO;
+	    break;
+	 }
+	 fill += len;
+      }
+   }
+   if (!retval && fill)
+      retval = scull_save_extent(f, fpos, start, buf, fill);
+   if (!retval)
+      retval = scull_save_extent(f, fpos, 0, NULL, 0); /* the end */
+   vfree(buf);
+   return retval;
+}
+
+/*
+ * Move the new image, complete on disk, over the old one. Both are
+ * in the same directory, so this is a plain rename.
+ */
+static int scull_persist_replace(struct file *f) {
+   struct dentry *tmp = f->f_path.dentry, *dir, *target;
+   const char *name = kbasename(scull_backing);
+   int retval;
+
+   retval = mnt_want_write(f->f_path.mnt);
+   if (retval)
+      return retval;
+   dir = dget_parent(tmp);
+   lock_rename(dir, dir);
+   target = lookup_one_len(name, dir, strlen(name));
+   if (IS_ERR(target)) {
+      retval = PTR_ERR(target);
+   } else {
+      if (tmp->d_parent != dir)
+	 retval = -ENOENT; /* somebody moved it meanwhile */
+      else
+	 retval = vfs_rename(dir->d_inode, tmp, dir->d_inode, target,
+			     NULL, 0);
+      dput(target);
+   }
+   unlock_rename(dir, dir);
+   dput(dir);
+   mnt_drop_write(f->f_path.mnt);
+   return retval;
+}
+
+int scull_persist_save(void) {
+   struct scull_persist_header hdr;
+   struct scull_dev *dev;
+   struct file *f;
+   loff_t fpos = 0;
+   char *tmpname;
+   int i, retval;
+
+   if (!scull_backing || !*scull_backing)
+      return -ENOENT;
+   if (!scull_persist_ready)
+      return -EROFS; /* see scull_persist_restore */
+   tmpname = kasprintf(GFP_KERNEL, "%s.tmp", scull_backing);
+   if (!tmpname)
+      return -ENOMEM;
+   f = filp_open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+   kfree(tmpname);
+   if (IS_ERR(f))
+      return PTR_ERR(f);
+
+   hdr.magic = SCULL_PERSIST_MAGIC;
+   hdr.version = SCULL_PERSIST_VERSION;
+   hdr.nr_devs = scull_nr_devs;
+   hdr.reserved = 0;
+   retval = scull_persist_io(f, &hdr, sizeof(hdr), &fpos, 1);
+   for (i = 0; i < scull_nr_devs && !retval; i++) {
+      dev = scull_devices + i;
+      down_write(&dev->sem);
+      retval = scull_save_dev(f, &fpos, dev, i);
+      up_write(&dev->sem);
+   }
+   if (!retval)
+      retval = vfs_fsync(f, 0);
+   if (!retval)
+      retval = scull_persist_replace(f);
+   filp_close(f, NULL);
+   if (retval)
+      printk(KERN_WARNING "scull: saving to %s failed (%i)\n",
+	     scull_backing, retval);
+   return retval;
+}
+
+/*
+ * Restore one device: the geometry is switched while it is empty, then
+ * the extents are written back like any write would.
+ */
+static int scull_restore_dev(struct file *f, loff_t *fpos,
+			     struct scull_persist_dev *rec) {
+   struct scull_persist_extent ext;
+   struct scull_dev *dev = scull_devices + rec->index;
+   size_t chunk, bufsize;
+   loff_t done;
+   int retval = 0;
+   char *buf;
+
+   buf = scull_persist_buffer(rec->quantum, &bufsize);
+   if (!buf)
+      return -ENOMEM;
+   down_write(&dev->sem);
+   scull_trim(dev);
+   write_seqcount_begin(&dev->seq);
+   dev->quantum = rec->quantum;
+   dev->qset = rec->qset;
+   dev->own_geometry = rec->quantum != scull_quantum ||
+		       rec->qset != scull_qset;
+   write_seqcount_end(&dev->seq);
+   downgrade_write(&dev->sem); /* now it's like any writer */
+
+   for (;;) {
+      retval = scull_persist_io(f, &ext, sizeof(ext), fpos, 0);
+      if (retval || !ext.length)
+	 break;
+      if (ext.offset + ext.length > rec->size ||
+	  ext.offset + ext.length < ext.offset) {
+	 retval = -EINVAL;
+	 break;
+      }
+      for (done = 0; done < ext.length && !retval; done += chunk) {
+	 chunk = min_t(__u64, bufsize, ext.length - done);
+	 retval = scull_persist_io(f, buf, chunk, fpos, 0);
+	 if (!retval &&
+	     scull_kernel_write(dev, buf, chunk, ext.offset + done) != chunk)
+	    retval = -ENOSPC; /* the limit, or out of memory */
+      }
+      if (retval)
+	 break;
+   }
+   if (!retval) { /* trailing holes are part of it too */
+      spin_lock(&dev->lock);
+      dev->size = rec->size;
+      spin_unlock(&dev->lock);
+   }
+   up_read(&dev->sem);
+   vfree(buf);
+   return retval;
+}
+
+int scull_persist_restore(void) {
+   struct scull_persist_header hdr;
+   struct scull_persist_dev rec;
+   struct file *f;
+   loff_t fpos = 0;
+   int i, retval;
+
+   if (!scull_backing || !*scull_backing)
+      return 0;
+   f = filp_open(scull_backing, O_RDONLY | O_LARGEFILE, 0);
+   if (IS_ERR(f)) {
+      retval = PTR_ERR(f);
+      if (retval == -ENOENT) { /* first time: nothing to restore */
+	 scull_persist_ready = 1;
+	 retval = 0;
+      }
+      goto out;
+   }
+   retval = scull_persist_io(f, &hdr, sizeof(hdr), &fpos, 0);
+   if (!retval && (hdr.magic != SCULL_PERSIST_MAGIC ||
+		   hdr.version != SCULL_PERSIST_VERSION))
+      retval = -EINVAL;
+   for (i = 0; i < hdr.nr_devs && !retval; i++) {
+      retval = scull_persist_io(f, &rec, sizeof(rec), &fpos, 0);
+      if (retval)
+	 break;
+      /* the same checks as SCULL_IOCSGEOMETRY */
+      if (rec.index >= scull_nr_devs ||
+	  !scull_geometry_valid(rec.quantum, rec.qset)) {
+	 retval = -EINVAL;
+	 break;
+      }
+      retval = scull_restore_dev(f, &fpos, &rec);
+   }
+   filp_close(f, NULL);
+   if (!retval)
+      scull_persist_ready = 1;
+ out:
+   if (retval)
+      printk(KERN_WARNING "scull: restoring from %s failed (%i), "
+	     "it won't be saved to\n", scull_backing, retval);
+   return retval;
+}
+
+/*
+ * At unload, before the devices are emptied.
+ */
+void scull_persist_cleanup(void) {
+   if (scull_persist_ready)
+      scull_persist_save();
+   scull_persist_ready = 0;
+}
@@ -30,16 +30,49 @@
 #include <linux/fcntl.h>
 #include <linux/poll.h>
 #include <linux/cdev.h>
+#include <linux/mutex.h>
+#include <linux/cache.h>        /* ____cacheline_aligned_in_smp */
+#include <linux/log2.h>         /* roundup_pow_of_two() */
+#include <linux/vmalloc.h>
+#include <linux/mm.h>           /* is_vmalloc_addr() */
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/highmem.h>      /* kmap() */
 #include <asm/uaccess.h>
 
 #include "scull.h"              /* local definitions */
+#include "scull_trace.h"
 
+/*
+ * The buffer is a ring of a power-of-two size. rp and wp count the
+ * bytes read and written since the ring was last emptied, and only wrap
+ * around with the unsigned arithmetic: wp - rp is what the ring holds
+ * (empty if 0, full if buffersize, no slot is lost), and an index
+ * masked with buffersize - 1 is where in the buffer it points.
+ *
+ * rp only ever moves in read and wp in write. Each sits on a cache
+ * line of its own, with the lock of its side: in SPSC mode (see
+ * scull_p_spsc) readers only serialize among themselves on rlock,
+ * writers on wlock, and the two sides only meet at rp and wp.
+ *
+ * Normally an open empties the ring and the last close frees it. A
+ * persistent pipe (see scull_p_persist) keeps both: what is written
+ * stays queued for whoever opens it next, and the ring is only freed
+ * at unload. An open for writing with O_TRUNC empties it.
+ */
 struct scull_pipe {
-   wait_queue_head_t inq, outq;       /* read and write queues */
-   char *buffer, *end;                /* begin of buf, end of buf */
-   int buffersize;                    /* used in pointer arithmetic */
-   char *rp, *wp;                     /* where to read, where to write */
+   unsigned int rp ____cacheline_aligned_in_smp;  /* bytes read */
+   struct mutex rlock;                /* readers, in SPSC mode */
+   unsigned int wp ____cacheline_aligned_in_smp;  /* bytes written */
+   struct mutex wlock;                /* writers, in SPSC mode */
+   wait_queue_head_t inq ____cacheline_aligned_in_smp; /* read queue */
+   wait_queue_head_t outq;            /* write queue */
+   char *buffer;                      /* the ring */
+   unsigned int buffersize;           /* a power of two */
    int nreaders, nwriters;            /* number of openings for r/w */
+   int node;                          /* where the buffer goes */
+   int spsc;                          /* split locking, see above */
+   int persist;                       /* data and ring outlive opens */
    struct fasync_struct *async_queue; /* asynchronous readers */
    struct semaphore sem;              /* mutual exclusion semaphore */
    struct cdev cdev;                  /* Char device structure */
@@ -48,16 +81,125 @@ struct scull_pipe {
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;   /* number of pipe devices */
 int scull_p_buffer =  SCULL_P_BUFFER;   /* buffer size */
+int scull_p_max_buffer = SCULL_P_MAX_BUFFER; /* unprivileged sizes */
+static int scull_p_spsc = 0;            /* split reader/writer locking */
+static int scull_p_persist = 0;         /* keep the rings between opens */
 dev_t scull_p_devno;                    /* Our first device number */
 
 module_param(scull_p_nr_devs, int, 0);  /* FIXME check perms */
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_max_buffer, int, S_IRUGO | S_IWUSR);
+module_param(scull_p_spsc, int, S_IRUGO);
+module_param(scull_p_persist, int, S_IRUGO);
 
 static struct scull_pipe *scull_p_devices;
 
 static int scull_p_fasync(int fd, struct file *filp, int mode);
 static int spacefree(struct scull_pipe *dev);
+extern struct file_operations scull_pipe_fops;
 
+/*
+ * Take the lock of one side (rlock or wlock) for I/O: the device
+ * semaphore, unless the pipe is in SPSC mode. How long we waited for
+ * it, if we had to, is traced.
+ *
+ * Either way, the index of the other side is read once (ACCESS_ONCE)
+ * and only trusted along with the barriers that pair up around it:
+ * the writer fills the buffer before it moves wp, the reader is done
+ * with the data before it moves rp.
+ */
+static int scull_p_trylock(struct scull_pipe *dev, struct mutex *side) {
+   return dev->spsc ? mutex_trylock(side) : !down_trylock(&dev->sem);
+}
+
+static int scull_p_lock(struct scull_pipe *dev, struct mutex *side) {
+   u64 start;
+   int err;
+   
+   if (scull_p_trylock(dev, side))
+      return 0;
+   start = scull_trace_clock(scull_sem_wait);
+   if (dev->spsc)
+      err = mutex_lock_interruptible(side);
+   else
+      err = down_interruptible(&dev->sem);
+   if (err)
+      return -ERESTARTSYS;
+   trace_scull_sem_wait(dev->cdev.dev, scull_trace_since(start));
+   return 0;
+}
+
+static void scull_p_unlock(struct scull_pipe *dev, struct mutex *side) {
+   if (dev->spsc)
+      mutex_unlock(side);
+   else
+      up(&dev->sem);
+}
+
+/*
+ * Wake the other side up, if it sleeps: the barrier orders the index
+ * we just moved against the look at the queue, as prepare_to_wait
+ * does on the sleeper's side.
+ */
+static void scull_p_wake(wait_queue_head_t *q) {
+   smp_mb();
+   if (waitqueue_active(q))
+      wake_up_interruptible(q);
+}
+
+
+/*
+ * The node the buffer is allocated on, next time it is: an interleaved
+ * pipe has nothing to spread, its buffer goes where it is opened.
+ */
+static int scull_p_buffer_node(struct scull_pipe *dev) {
+   return dev->node >= 0 ? dev->node : NUMA_NO_NODE;
+}
+
+/*
+ * For scull_ioctl, which only calls these with pipes.
+ */
+void scull_p_set_node(struct file *filp, int node) {
+   struct scull_pipe *dev = filp->private_data;
+   
+   dev->node = node;
+}
+
+int scull_p_get_node(struct file *filp) {
+   struct scull_pipe *dev = filp->private_data;
+   
+   return dev->node;
+}
+
+/*
+ * A size, rounded up to the ring size it stands for.
+ */
+static unsigned int scull_p_ring_size(unsigned long size) {
+   size = max(size, 2UL);
+   return roundup_pow_of_two(min_t(unsigned long, size, SCULL_P_MAX_RING));
+}
+
+/*
+ * Rings of a few pages are kmalloc'ed; bigger ones, or when memory is
+ * too fragmented for kmalloc, are vmalloc'ed: a ring is only ever
+ * touched by the CPU, it needs no physically contiguous memory.
+ */
+static char *scull_p_ring_alloc(unsigned int size, int node) {
+   char *ring = NULL;
+   
+   if (size <= PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)
+      ring = kmalloc_node(size, GFP_KERNEL | __GFP_NOWARN, node);
+   if (!ring)
+      ring = vmalloc_node(size, node);
+   return ring;
+}
+
+static void scull_p_ring_free(char *ring) {
+   if (is_vmalloc_addr(ring))
+      vfree(ring);
+   else
+      kfree(ring);
+}
 
 static int scull_p_open(struct inode *inode, struct file *filp) {
    struct scull_pipe *dev;
@@ -68,15 +210,24 @@ static int scull_p_open(struct inode *inode, struct file *filp) {
    if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
    if (!dev->buffer) {
       /* allocate the buffer */
-      dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
+      dev->buffersize = scull_p_ring_size(max(scull_p_buffer, 2));
+      dev->buffer = scull_p_ring_alloc(dev->buffersize,
+				       scull_p_buffer_node(dev));
       if (!dev->buffer) {
 	 up(&dev->sem);
 	 return -ENOMEM;
       }
    }
-   dev->buffersize = scull_p_buffer;
-   dev->end = dev->buffer + dev->buffersize;
-   dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
+   if (!dev->persist ||
+       ((filp->f_mode & FMODE_WRITE) && (filp->f_flags & O_TRUNC))) {
+      mutex_lock(&dev->rlock); /* no I/O while we reset (SPSC mode) */
+      mutex_lock(&dev->wlock);
+      dev->rp = dev->wp = 0; /* rd and wr from the beginning */
+      mutex_unlock(&dev->wlock);
+      mutex_unlock(&dev->rlock);
+      if (dev->persist)
+	 scull_p_wake(&dev->outq); /* room for writers still there */
+   }
    
    /* use f_mode, not f_flags: it's cleaner (fs/open.c tells why) */
    if (filp->f_mode & FMODE_READ) dev->nreaders++;
@@ -96,30 +247,96 @@ static int scull_p_release(struct inode *inode, struct file *filp) {
       dev->nreaders--;
    if (filp->f_mode & FMODE_WRITE)
       dev->nwriters--;
-   if (dev->nreaders + dev->nwriters == 0) {
-      kfree(dev->buffer);
+   if (dev->nreaders + dev->nwriters == 0 && !dev->persist) {
+      scull_p_ring_free(dev->buffer);
       dev->buffer = NULL; /* the other fields are not checked on open */
    }
    up(&dev->sem);
    return 0;
 }
 
-static ssize_t scull_p_read (struct file *filp, 
-			     char __user *buf, 
-			     size_t count,
-			     loff_t *f_pos) {
+/*
+ * For scull_ioctl: the ring of an open pipe, as opposed to the default
+ * size of the ones to come (scull_p_buffer). A resize keeps what the
+ * ring holds, so it fails if that would not fit, and lasts until the
+ * pipe is last closed (for good if it is persistent). Above
+ * scull_p_max_buffer, it takes
+ * CAP_SYS_RESOURCE, as F_SETPIPE_SZ does above pipe-max-size.
+ */
+int scull_p_resize(struct file *filp, unsigned long size) {
+   struct scull_pipe *dev = filp->private_data;
+   unsigned int used, off, first;
+   char *ring, *old;
+   int retval;
+   
+   if (filp->f_op != &scull_pipe_fops)
+      return -ENOTTY;
+   size = scull_p_ring_size(size); /* what it costs is what counts */
+   if (size > scull_p_max_buffer && !capable(CAP_SYS_RESOURCE))
+      return -EPERM;
+   /* allocate first, not to hold up I/O meanwhile */
+   ring = scull_p_ring_alloc(size, scull_p_buffer_node(dev));
+   if (!ring)
+      return -ENOMEM;
+   if (down_interruptible(&dev->sem)) {
+      scull_p_ring_free(ring);
+      return -ERESTARTSYS;
+   }
+   mutex_lock(&dev->rlock); /* no I/O while we copy (SPSC mode) */
+   mutex_lock(&dev->wlock);
+   used = dev->wp - dev->rp;
+   if (used > size) {
+      retval = -EBUSY; /* read some first */
+   } else {
+      /* the data goes to the beginning of the new ring, in one piece */
+      off = dev->rp & (dev->buffersize - 1);
+      first = min(used, dev->buffersize - off);
+      memcpy(ring, dev->buffer + off, first);
+      memcpy(ring + first, dev->buffer, used - first);
+      old = dev->buffer;
+      dev->buffer = ring;
+      dev->buffersize = size;
+      dev->rp = 0;
+      dev->wp = used;
+      ring = old;
+      retval = size;
+   }
+   mutex_unlock(&dev->wlock);
+   mutex_unlock(&dev->rlock);
+   up(&dev->sem);
+   scull_p_ring_free(ring); /* the old one, or the one we didn't use */
+   if (retval > 0)
+      scull_p_wake(&dev->outq); /* there may be room now */
+   return retval;
+}
+
+int scull_p_get_ring(struct file *filp) {
+   struct scull_pipe *dev = filp->private_data;
+   
+   if (filp->f_op != &scull_pipe_fops)
+      return -ENOTTY;
+   return ACCESS_ONCE(dev->buffersize);
+}
+
+static ssize_t scull_p_do_read (struct file *filp, 
+				char __user *buf, 
+				size_t count,
+				loff_t *f_pos) {
 
    struct scull_pipe *dev = filp->private_data;
+   unsigned int wp, off, first;
+   u64 start;
+   int err;
    
-   if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
+   if (scull_p_lock(dev, &dev->rlock)) return -ERESTARTSYS;
    
    /*
      The while loop tests the buffer with the device semaphore held. If
      there is data there, we know we can return it to the user immediately
      without sleeping, so the entire body of the loop is skipped.
    */
-   while (dev->rp == dev->wp) { /* nothing to read */
-      up(&dev->sem); /* release the lock */
+   while (dev->rp == (wp = ACCESS_ONCE(dev->wp))) { /* nothing to read */
+      scull_p_unlock(dev, &dev->rlock); /* release the lock */
 
       /* return if the user has requested non-blocking I/O */
       if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
@@ -141,7 +358,11 @@ static ssize_t scull_p_read (struct file *filp,
 	filesystem (VFS) layer, which either restarts the system call
 	or returns -EINTR to user space.
       */
-      if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
+      start = scull_trace_clock(scull_p_sleep);
+      err = wait_event_interruptible(dev->inq,
+				     (dev->rp != ACCESS_ONCE(dev->wp)));
+      trace_scull_p_sleep(dev->cdev.dev, 0, err, scull_trace_since(start));
+      if (err)
 	 return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
 
       /*
@@ -153,28 +374,30 @@ static ssize_t scull_p_read (struct file *filp,
          again (in the while loop) and truly know that we can return
          the data in the buffer to the user.
       */
-      if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
+      if (scull_p_lock(dev, &dev->rlock)) return -ERESTARTSYS;
    }
+   smp_rmb(); /* the data up to wp is there: see scull_p_do_write */
 
    /*
       We know that the semaphore is held and the buffer contains data
-      that we can use.  We can now read the data
+      that we can use.  We can now read the data: if it goes around
+      the end of the buffer, both parts of it in one go
    */
-   if (dev->wp > dev->rp) count = min(count, (size_t)(dev->wp - dev->rp));
-   else /* the write pointer has wrapped, return data up to dev->end */
-      count = min(count, (size_t)(dev->end - dev->rp));
-
-   if (copy_to_user(buf, dev->rp, count)) {
-      up (&dev->sem);
+   count = min(count, (size_t)(wp - dev->rp));
+   off = dev->rp & (dev->buffersize - 1);
+   first = min(count, (size_t)(dev->buffersize - off));
+   if (copy_to_user(buf, dev->buffer + off, first) ||
+       copy_to_user(buf + first, dev->buffer, count - first)) {
+      scull_p_unlock(dev, &dev->rlock);
       return -EFAULT;
    }
 
-   dev->rp += count;
-   if (dev->rp == dev->end) dev->rp = dev->buffer; /* wrapped */
-   up (&dev->sem);
+   smp_mb(); /* done with the data before the writer may reuse it */
+   ACCESS_ONCE(dev->rp) = dev->rp + count;
+   scull_p_unlock(dev, &dev->rlock);
    
    /* finally, awaken any writers and return */
-   wake_up_interruptible(&dev->outq);
+   scull_p_wake(&dev->outq);
    PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)count);
    return count;
 }
@@ -184,59 +407,69 @@ static ssize_t scull_p_read (struct file *filp,
 static int scull_getwritespace(struct scull_pipe *dev, struct file *filp) {
    while (spacefree(dev) == 0) { /* full */
       DEFINE_WAIT(wait);
+      u64 start;
       
-      up(&dev->sem);
+      scull_p_unlock(dev, &dev->wlock);
       if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
       PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
 
+      start = scull_trace_clock(scull_p_sleep);
       prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
       if (spacefree(dev) == 0) schedule();
 
       finish_wait(&dev->outq, &wait);
+      trace_scull_p_sleep(dev->cdev.dev, 1,
+			  signal_pending(current) ? -ERESTARTSYS : 0,
+			  scull_trace_since(start));
 
       /* signal: tell the fs layer to handle it */
       if (signal_pending(current)) return -ERESTARTSYS;
-      if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
+      if (scull_p_lock(dev, &dev->wlock)) return -ERESTARTSYS;
    }
    return 0;
 }       
 
-/* How much space is free? */
+/* How much space is free, with the reader at rp? */
+static int scull_p_space(struct scull_pipe *dev, unsigned int rp) {
+   return dev->buffersize - (dev->wp - rp);
+}
+
 static int spacefree(struct scull_pipe *dev) {
-   if (dev->rp == dev->wp) return dev->buffersize - 1;
-   return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+   return scull_p_space(dev, ACCESS_ONCE(dev->rp));
 }
 
-ssize_t scull_p_write(struct file *filp, 
-		      const char __user *buf, 
-		      size_t count,
-		      loff_t *f_pos) {
+static ssize_t scull_p_do_write(struct file *filp, 
+				const char __user *buf, 
+				size_t count,
+				loff_t *f_pos) {
    struct scull_pipe *dev = filp->private_data;
+   unsigned int rp, off, first;
    int result;
    
-   if (down_interruptible(&dev->sem)) return -ERESTARTSYS;
+   if (scull_p_lock(dev, &dev->wlock)) return -ERESTARTSYS;
    
    /* Make sure there's space to write */
    result = scull_getwritespace(dev, filp);
-   if (result) return result; /* scull_getwritespace called up(&dev->sem) */
-   
-   /* ok, space is there, accept something */
-   count = min(count, (size_t)spacefree(dev));
-   if (dev->wp >= dev->rp)
-      count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
-   else /* the write pointer has wrapped, fill up to rp-1 */
-      count = min(count, (size_t)(dev->rp - dev->wp - 1));
-   PDEBUG("Accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-   if (copy_from_user(dev->wp, buf, count)) {
-      up (&dev->sem);
+   if (result) return result; /* scull_getwritespace unlocked */
+   rp = ACCESS_ONCE(dev->rp);
+   smp_mb(); /* the reader is done with what is before rp */
+   
+   /* ok, space is there, accept something, around the end if need be */
+   count = min(count, (size_t)scull_p_space(dev, rp));
+   off = dev->wp & (dev->buffersize - 1);
+   first = min(count, (size_t)(dev->buffersize - off));
+   PDEBUG("Accept %li bytes to %u from %p\n", (long)count, off, buf);
+   if (copy_from_user(dev->buffer + off, buf, first) ||
+       copy_from_user(dev->buffer, buf + first, count - first)) {
+      scull_p_unlock(dev, &dev->wlock);
       return -EFAULT;
    }
-   dev->wp += count;
-   if (dev->wp == dev->end) dev->wp = dev->buffer; /* wrapped */
-   up(&dev->sem);
+   smp_wmb(); /* the data is there before wp says so */
+   ACCESS_ONCE(dev->wp) = dev->wp + count;
+   scull_p_unlock(dev, &dev->wlock);
    
    /* finally, awake any reader */
-   wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
+   scull_p_wake(&dev->inq);  /* blocked in read() and select() */
    
    /* and signal asynchronous readers, explained late in chapter 5 */
    if (dev->async_queue)
@@ -245,19 +478,174 @@ ssize_t scull_p_write(struct file *filp,
    return count;
 }
 
+/*
+ * read and write proper, traced on the way in and out.
+ */
+static ssize_t scull_p_read(struct file *filp, char __user *buf,
+			    size_t count, loff_t *f_pos) {
+   struct scull_pipe *dev = filp->private_data;
+   u64 start = scull_trace_clock(scull_p_read_end);
+   ssize_t retval;
+   
+   trace_scull_p_read_start(dev->cdev.dev, *f_pos, count);
+   retval = scull_p_do_read(filp, buf, count, f_pos);
+   trace_scull_p_read_end(dev->cdev.dev, *f_pos, retval,
+			  scull_trace_since(start));
+   return retval;
+}
+
+ssize_t scull_p_write(struct file *filp, const char __user *buf,
+		      size_t count, loff_t *f_pos) {
+   struct scull_pipe *dev = filp->private_data;
+   u64 start = scull_trace_clock(scull_p_write_end);
+   ssize_t retval;
+   
+   trace_scull_p_write_start(dev->cdev.dev, *f_pos, count);
+   retval = scull_p_do_write(filp, buf, count, f_pos);
+   trace_scull_p_write_end(dev->cdev.dev, *f_pos, retval,
+			   scull_trace_since(start));
+   return retval;
+}
+
+/*
+ * splice: reading copies what the buffer holds into fresh pages for
+ * the pipe (the buffer itself is reused at once, so it can't be lent
+ * out); writing feeds each pipe buffer to scull_p_write as it comes.
+ * Like the kernel's own fallback, what the pipe refuses (a signal,
+ * no reader left) after we took it from the buffer is lost.
+ */
+static const struct pipe_buf_operations scull_p_pipe_buf_ops = {
+   .can_merge = 0,
+   .map =       generic_pipe_buf_map,
+   .unmap =     generic_pipe_buf_unmap,
+   .confirm =   generic_pipe_buf_confirm,
+   .release =   generic_pipe_buf_release,
+   .steal =     generic_pipe_buf_steal,
+   .get =       generic_pipe_buf_get,
+};
+
+static void scull_p_spd_release(struct splice_pipe_desc *spd, unsigned int i) {
+   __free_page(spd->pages[i]);
+}
+
+static ssize_t scull_p_splice_read(struct file *filp, loff_t *ppos,
+				   struct pipe_inode_info *pipe, size_t len,
+				   unsigned int flags) {
+   struct scull_pipe *dev = filp->private_data;
+   struct page *pages[PIPE_DEF_BUFFERS];
+   struct partial_page partial[PIPE_DEF_BUFFERS];
+   struct splice_pipe_desc spd = {
+      .pages =        pages,
+      .partial =      partial,
+      .nr_pages_max = PIPE_DEF_BUFFERS,
+      .flags =        flags,
+      .ops =          &scull_p_pipe_buf_ops,
+      .spd_release =  scull_p_spd_release,
+   };
+   int nonblock = (filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+   ssize_t retval;
+   size_t count, done = 0;
+   unsigned int rp, wp, off;
+   int i, n;
+   
+   if (splice_grow_spd(pipe, &spd))
+      return -ENOMEM;
+   /* get the pages first, not to sleep for memory holding the lock */
+   for (n = 0; n < spd.nr_pages_max && n * PAGE_SIZE < len; n++) {
+      if (!(spd.pages[n] = alloc_page(GFP_KERNEL)))
+	 break;
+      spd.partial[n].offset = spd.partial[n].len = 0;
+   }
+   retval = -ENOMEM;
+   if (!n)
+      goto out;
+   
+   retval = -ERESTARTSYS;
+   if (scull_p_lock(dev, &dev->rlock))
+      goto out;
+   while (dev->rp == (wp = ACCESS_ONCE(dev->wp))) { /* as in scull_p_read */
+      scull_p_unlock(dev, &dev->rlock);
+      retval = -EAGAIN;
+      if (nonblock)
+	 goto out;
+      retval = -ERESTARTSYS;
+      if (wait_event_interruptible(dev->inq,
+				   (dev->rp != ACCESS_ONCE(dev->wp))))
+	 goto out;
+      if (scull_p_lock(dev, &dev->rlock))
+	 goto out;
+   }
+   smp_rmb(); /* the data up to wp is there */
+   /* as much as there is, one page (and one contiguous part) at a time */
+   rp = dev->rp;
+   while (done < len && rp != wp && spd.nr_pages < n) {
+      i = spd.nr_pages;
+      off = rp & (dev->buffersize - 1);
+      count = min(len - done, (size_t)(PAGE_SIZE - spd.partial[i].len));
+      count = min(count, (size_t)(wp - rp));
+      count = min(count, (size_t)(dev->buffersize - off));
+      memcpy(page_address(spd.pages[i]) + spd.partial[i].len,
+	     dev->buffer + off, count);
+      spd.partial[i].len += count;
+      if (spd.partial[i].len == PAGE_SIZE)
+	 spd.nr_pages++;
+      done += count;
+      rp += count;
+   }
+   if (spd.nr_pages < n && spd.partial[spd.nr_pages].len)
+      spd.nr_pages++; /* the last, partly filled page */
+   smp_mb(); /* done with the data before the writer may reuse it */
+   ACCESS_ONCE(dev->rp) = rp;
+   scull_p_unlock(dev, &dev->rlock);
+   scull_p_wake(&dev->outq);
+   
+   retval = splice_to_pipe(pipe, &spd);
+ out:
+   for (i = spd.nr_pages; i < n; i++) /* the pages never filled */
+      __free_page(spd.pages[i]);
+   splice_shrink_spd(&spd);
+   return retval;
+}
+
+static int scull_p_splice_actor(struct pipe_inode_info *pipe,
+				struct pipe_buffer *buf,
+				struct splice_desc *sd) {
+   loff_t pos = sd->pos;
+   mm_segment_t old_fs;
+   char *addr;
+   int retval;
+   
+   addr = kmap(buf->page);
+   old_fs = get_fs();
+   set_fs(KERNEL_DS); /* scull_p_write copies "from user" */
+   retval = scull_p_write(sd->u.file, (const char __user *)addr + buf->offset,
+			  sd->len, &pos);
+   set_fs(old_fs);
+   kunmap(buf->page);
+   return retval;
+}
+
+static ssize_t scull_p_splice_write(struct pipe_inode_info *pipe,
+				    struct file *filp, loff_t *ppos,
+				    size_t len, unsigned int flags) {
+   return splice_from_pipe(pipe, filp, ppos, len, flags,
+			   scull_p_splice_actor);
+}
+
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait) {
    struct scull_pipe *dev = filp->private_data;
    unsigned int mask = 0;
    
    /*
     * The buffer is circular; it is considered full
-    * if "wp" is right behind "rp" and empty if the
-    * two are equal.
+    * if "wp" is a whole buffer ahead of "rp" and empty
+    * if the two are equal.
     */
    down(&dev->sem);
    poll_wait(filp, &dev->inq,  wait);
    poll_wait(filp, &dev->outq, wait);
-   if (dev->rp != dev->wp) mask |= POLLIN | POLLRDNORM;    /* readable */
+   if (ACCESS_ONCE(dev->rp) != ACCESS_ONCE(dev->wp))
+      mask |= POLLIN | POLLRDNORM;    /* readable */
    if (spacefree(dev)) mask |= POLLOUT | POLLWRNORM;   /* writable */
    up(&dev->sem);
    return mask;
@@ -300,11 +688,11 @@ static int scull_read_p_mem(char *buf,
       if (down_interruptible(&p->sem)) return -ERESTARTSYS;
       len += sprintf(buf+len, "\nDevice %i: %p\n", i, p);
       /* len += sprintf(buf+len, "   Queues: %p %p\n", p->inq, p->outq);*/
-      len += sprintf(buf+len, "   Buffer: %p to %p (%i bytes)\n", 
-		     p->buffer, p->end, p->buffersize);
-      len += sprintf(buf+len, "   rp %p   wp %p\n", p->rp, p->wp);
-      len += sprintf(buf+len, "   readers %i   writers %i\n", 
-		     p->nreaders, p->nwriters);
+      len += sprintf(buf+len, "   Buffer: %p (%u bytes)\n", 
+		     p->buffer, p->buffersize);
+      len += sprintf(buf+len, "   rp %u   wp %u\n", p->rp, p->wp);
+      len += sprintf(buf+len, "   readers %i   writers %i%s\n", 
+		     p->nreaders, p->nwriters, p->persist ? "   persistent" : "");
       up(&p->sem);
       scullp_proc_offset(buf, start, &offset, &len);
    }
@@ -322,6 +710,8 @@ struct file_operations scull_pipe_fops = {
    .llseek =       no_llseek,
    .read =         scull_p_read,
    .write =        scull_p_write,
+   .splice_read =  scull_p_splice_read,
+   .splice_write = scull_p_splice_write,
    .poll =         scull_p_poll,
    .unlocked_ioctl =        scull_ioctl,
    .open =         scull_p_open,
@@ -365,6 +755,11 @@ int scull_p_init(dev_t firstdev) {
       init_waitqueue_head(&(scull_p_devices[i].inq));
       init_waitqueue_head(&(scull_p_devices[i].outq));
       sema_init(&scull_p_devices[i].sem, 1);
+      mutex_init(&scull_p_devices[i].rlock);
+      mutex_init(&scull_p_devices[i].wlock);
+      scull_p_devices[i].node = scull_node;
+      scull_p_devices[i].spsc = scull_p_spsc;
+      scull_p_devices[i].persist = scull_p_persist;
       scull_p_setup_cdev(scull_p_devices + i, i);
    }
 #ifdef SCULL_DEBUG
@@ -388,7 +783,7 @@ void scull_p_cleanup(void) {
    
    for (i = 0; i < scull_p_nr_devs; i++) {
       cdev_del(&scull_p_devices[i].cdev);
-      kfree(scull_p_devices[i].buffer);
+      scull_p_ring_free(scull_p_devices[i].buffer);
    }
    kfree(scull_p_devices);
    unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
@@ -19,6 +19,7 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include <linux/types.h> /* __u64, for struct scull_range */
 
 /*
  * Macros to help debugging
@@ -52,45 +53,146 @@
 #define SCULL_P_NR_DEVS 4  /* scullpipe0 through scullpipe3 */
 #endif
 
+#ifndef SCULL_N_SNAPS
+#define SCULL_N_SNAPS 4    /* scullsnap0 through scullsnap3 */
+#endif
+
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use a radix tree of indirect blocks, keyed by item number.
  *
- * "scull_dev->data" points to an array of pointers, each
+ * Each item (quantum-set) holds an array of pointers, each
  * pointer refers to a memory area of SCULL_QUANTUM bytes.
  *
- * The array (quantum-set) is SCULL_QSET long.
+ * The array (quantum-set) is SCULL_QSET long. Quanta (and whole
+ * quantum-sets) that were never written are holes: they take no
+ * memory and read back as zeros.
  */
 #ifndef SCULL_QUANTUM
-#define SCULL_QUANTUM 4000
+#define SCULL_QUANTUM PAGE_SIZE  /* whole pages can be mmap'ed */
 #endif
 
 #ifndef SCULL_QSET
-#define SCULL_QSET    1000
+#define SCULL_QSET    (PAGE_SIZE / sizeof(void *)) /* an array fills a page */
+#endif
+
+/*
+ * How many quanta, arrays and items are held in reserve for writers
+ * when memory is tight.
+ */
+#ifndef SCULL_POOL_MIN
+#define SCULL_POOL_MIN 16
+#endif
+
+/*
+ * Huge quanta: a quantum the size of what one page-middle-directory
+ * entry maps (2MB on x86) is allocated as a single compound page,
+ * or vmalloc'ed when no such page is to be had.
+ * Devices get them with the geometry ioctl, or all of them at load
+ * time with scull_huge=1. Being that big, fewer of them are kept in
+ * reserve.
+ */
+#define SCULL_HUGE_QUANTUM PMD_SIZE
+
+#ifndef SCULL_HUGE_POOL_MIN
+#define SCULL_HUGE_POOL_MIN 2
 #endif
 
+/*
+ * Where the memory of a device comes from (scull_node, SCULL_IOCSNODE):
+ * a node number, the node of whoever writes, or all of them in turn.
+ */
+#define SCULL_NODE_LOCAL      (-1)      /* NUMA_NO_NODE */
+#define SCULL_NODE_INTERLEAVE (-2)
+
 /*
  * The pipe device is a simple circular buffer. Here its default size
+ * (rounded up to a power of two when the buffer is allocated)
  */
 #ifndef SCULL_P_BUFFER
-#define SCULL_P_BUFFER 4000
+#define SCULL_P_BUFFER 4096
+#endif
+
+/*
+ * How big a pipe may be resized to without CAP_SYS_RESOURCE (the
+ * default for scull_p_max_buffer), and at all.
+ */
+#ifndef SCULL_P_MAX_BUFFER
+#define SCULL_P_MAX_BUFFER (16 * 1024 * 1024)
 #endif
+#define SCULL_P_MAX_RING   (1UL << 30)
    
 /*
  * Representation of scull quantum sets.
  */
 struct scull_qset {
    void **data;
-   struct scull_qset *next;
+   struct scull_sarray *shared; /* data is shared with a snapshot */
+   unsigned long item;       /* our key in scull_dev->index */
+   unsigned long stamp;      /* jiffies at the last write */
+   int dirty;                /* written since a relayout copied it */
+   struct mutex mutex;       /* serializes writers to this item */
 };
 
+/*
+ * An array of quanta that items of several devices point to: a
+ * snapshot and its source (see scull_share_index).
+ */
+struct scull_sarray {
+   atomic_t refs;            /* items pointing here */
+   void **data;
+   int quantum, qset;
+   struct rcu_head rcu;
+};
+
+/*
+ * A quantum that was compressed (see compress.c) is kept in its slot
+ * with the low bit of the pointer set; one shared with other slots
+ * (see dedupe.c) with the next bit set.
+ */
+#define SCULL_ZTAG        1UL
+#define SCULL_STAG        2UL
+#define SCULL_ZQUANTUM(q) ((unsigned long)(q) & SCULL_ZTAG)
+#define SCULL_SQUANTUM(q) ((unsigned long)(q) & SCULL_STAG)
+
+/*
+ * What a bare device counts, on each CPU (see stats.c). Other devices
+ * made of a scull_dev have no counters: stats is NULL.
+ */
+struct scull_stats {
+   unsigned long reads;      /* calls that got to the data */
+   unsigned long writes;
+   unsigned long rbytes;     /* bytes they moved */
+   unsigned long wbytes;
+   unsigned long trims;
+   unsigned long nomem;      /* writes and faults out of memory */
+   u64 semwait;              /* ns spent waiting for the semaphore */
+};
+
+#define scull_stat_add(dev, field, n)					\
+   do {									\
+      if ((dev)->stats)							\
+	 this_cpu_add((dev)->stats->field, (n));			\
+   } while (0)
+
 struct scull_dev {
-   struct scull_qset *data;  /* Pointer to first quantum set */
+   struct radix_tree_root index; /* item number -> quantum set */
    int quantum;              /* the current quantum size */
    int qset;                 /* the current array size */
+   int own_geometry;         /* set per device: trim keeps it */
    unsigned long size;       /* amount of data stored here */
+   unsigned long limit;      /* most bytes of quanta allowed, 0: any */
+   atomic_long_t used;       /* bytes of quanta allocated */
+   int node;                 /* node or SCULL_NODE_*, for new memory */
    unsigned int access_key;  /* used by sculluid and scullpriv */
-   struct semaphore sem;     /* mutual exclusion semaphore     */
+   atomic_t vmas;            /* active mappings */
+   unsigned long maps;       /* mmap calls so far, under sem */
+   struct rw_semaphore sem;  /* shared for I/O, exclusive to trim */
+   spinlock_t lock;          /* protects size and index insertion */
+   seqcount_t seq;           /* bumped by trim, for lockless readers */
+   atomic_long_t trimming;   /* trimmed bytes not yet freed */
+   wait_queue_head_t trimq;  /* to wait for them */
+   struct scull_stats __percpu *stats;
    struct cdev cdev;         /* Char device structure              */
 };
 
@@ -108,8 +210,15 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern unsigned long scull_limit;
+extern int scull_huge;
+extern int scull_node;
+extern struct scull_dev *scull_devices;
+extern struct dentry *scull_debugfs;
+extern struct srcu_struct scull_srcu;  /* readers of the index */
 
 extern int scull_p_buffer;      /* pipe.c */
+extern int scull_p_max_buffer;
 
 
 /*
@@ -118,17 +227,71 @@ extern int scull_p_buffer;      /* pipe.c */
 
 int     scull_p_init(dev_t dev);
 void    scull_p_cleanup(void);
+void    scull_p_set_node(struct file *filp, int node);
+int     scull_p_get_node(struct file *filp);
+int     scull_p_resize(struct file *filp, unsigned long size);
+int     scull_p_get_ring(struct file *filp);
 int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
+int     scull_snap_init(dev_t dev);
+void    scull_snap_cleanup(void);
+int     scull_snapshot(struct scull_dev *dev);
+int     scull_snap_drop(int n);
 
+void    scull_init_dev(struct scull_dev *dev);
 int     scull_trim(struct scull_dev *dev);
+int     scull_geometry_valid(int quantum, int qset);
+void    scull_flush_work(void);
+int     scull_quantum_paged(int quantum);
+int     scull_quantum_huge(int quantum);
+struct page *scull_quantum_page(void *p);
+void   *scull_alloc_quantum(int quantum, int node);
+void    scull_free_quantum(void *q, int quantum);
+void    scull_retire_quantum(void *q, int quantum);
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long n);
+int     scull_share_index(struct scull_dev *dev, struct scull_dev *snap);
+int     scull_sarray_reclaim(struct scull_qset *dptr);
+void   *scull_quantum_at(struct scull_dev *dev, struct scull_qset *dptr,
+			 int s_pos);
+void    scull_compress_init(void);
+void    scull_compress_cleanup(void);
+void    scull_zfree(void *zq);
+int     scull_zunpack(void *zq, void *dst, int quantum);
+int     scull_zread(char __user *buf, void *zq, int q_pos, size_t count,
+		    int quantum);
+int     scull_zcopy(void *dst, void *zq, int q_pos, size_t count,
+		    int quantum);
+void   *scull_share(void *q, int quantum);
+void   *scull_swrap(void *q, int quantum);
+void   *scull_sget(void *sq);
+void   *scull_sdata(void *sq);
+void    scull_sput(void *sq);
+void   *scull_sunwrap(void *sq);
 
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
 		   loff_t *f_pos);
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 		    loff_t *f_pos);
+ssize_t scull_aio_read(struct kiocb *iocb, const struct iovec *iov,
+		       unsigned long nr_segs, loff_t pos);
+ssize_t scull_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			unsigned long nr_segs, loff_t pos);
+ssize_t scull_splice_read(struct file *filp, loff_t *ppos,
+			  struct pipe_inode_info *pipe, size_t len,
+			  unsigned int flags);
+ssize_t scull_splice_write(struct pipe_inode_info *pipe, struct file *filp,
+			   loff_t *ppos, size_t len, unsigned int flags);
+ssize_t scull_kernel_read(struct scull_dev *dev, void *buf, size_t count,
+			  loff_t pos);
+ssize_t scull_kernel_write(struct scull_dev *dev, const void *buf,
+			   size_t count, loff_t pos);
+int     scull_persist_restore(void);
+int     scull_persist_save(void);
+void    scull_persist_cleanup(void);
+void    scull_stats_init(void);
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
 long    scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int     scull_mmap(struct file *filp, struct vm_area_struct *vma);
 
 
 /*
@@ -169,9 +332,112 @@ long    scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * Preallocate, or punch a hole in, a range of a bare device.
+ */
+struct scull_range {
+   __u64 offset;
+   __u64 length;
+};
+
+/* The most one preallocation takes, on a device without a limit */
+#ifndef SCULL_PREALLOC_MAX
+#define SCULL_PREALLOC_MAX (1LL << 32)
+#endif
+
+#define SCULL_IOCPREALLOC _IOW(SCULL_IOC_MAGIC, 15, struct scull_range)
+#define SCULL_IOCPUNCH    _IOW(SCULL_IOC_MAGIC, 16, struct scull_range)
+
+/* Wait until the memory of earlier trims has been freed */
+#define SCULL_IOCWTRIM    _IO(SCULL_IOC_MAGIC,  17)
+
+/*
+ * The geometry of one bare device. Setting it on a device holding
+ * data relayouts the data in the background; "G" shows when done.
+ * Quanta smaller than SCULL_MIN_QUANTUM take CAP_SYS_ADMIN: the
+ * arrays and items that hold them are not counted against the limit.
+ */
+#ifndef SCULL_MIN_QUANTUM
+#define SCULL_MIN_QUANTUM PAGE_SIZE
+#endif
+
+struct scull_geometry {
+   int quantum;
+   int qset;
+};
+
+#define SCULL_IOCSGEOMETRY _IOW(SCULL_IOC_MAGIC, 18, struct scull_geometry)
+#define SCULL_IOCGGEOMETRY _IOR(SCULL_IOC_MAGIC, 19, struct scull_geometry)
+
+/*
+ * How many bytes of quanta a bare device may allocate, 0 for no
+ * limit. Writes past it fail with ENOSPC.
+ */
+#define SCULL_IOCSLIMIT   _IOW(SCULL_IOC_MAGIC, 20, __u64)
+#define SCULL_IOCGLIMIT   _IOR(SCULL_IOC_MAGIC, 21, __u64)
+
+/*
+ * A batch of commands for a bare device, run in a single call. Reads
+ * and writes are at the given offset and leave the file position
+ * alone; each command gets its result (bytes, a value, or -errno),
+ * and "done" tells how many were run.
+ */
+#define SCULL_CMD_READ    0
+#define SCULL_CMD_WRITE   1
+#define SCULL_CMD_QUANTUM 2   /* result is the quantum */
+#define SCULL_CMD_QSET    3   /* result is the qset */
+#define SCULL_CMD_TRIM    4
+
+struct scull_cmd {
+   __u32 op;
+   __u32 reserved;
+   __s64 result;
+   __u64 offset;
+   __u64 addr;               /* user buffer for read and write */
+   __u64 len;
+};
+
+struct scull_batch {
+   __u64 cmds;               /* user pointer to the array */
+   __u32 count;
+   __u32 done;
+};
+
+#define SCULL_IOCBATCH    _IOWR(SCULL_IOC_MAGIC, 22, struct scull_batch)
+
+/*
+ * Snapshots: "Take" returns the number of the scullsnap device that
+ * now holds a read-only copy of this one; "Drop" empties the given
+ * scullsnap device, which must not be open.
+ */
+#define SCULL_IOCTSNAPSHOT _IO(SCULL_IOC_MAGIC, 23)
+#define SCULL_IOCTSNAPDROP _IO(SCULL_IOC_MAGIC, 24)
+
+/*
+ * Save the bare devices to the scull_backing file now, not only at
+ * unload. Fails with ENOENT if there is no such file.
+ */
+#define SCULL_IOCSAVE     _IO(SCULL_IOC_MAGIC, 25)
+
+/*
+ * NUMA placement of a device or a pipe, through a pointer to an int:
+ * a node, SCULL_NODE_LOCAL or SCULL_NODE_INTERLEAVE.
+ */
+#define SCULL_IOCSNODE    _IOW(SCULL_IOC_MAGIC, 26, int)
+#define SCULL_IOCGNODE    _IOR(SCULL_IOC_MAGIC, 27, int)
+
+/*
+ * The ring of one open pipe, as opposed to SCULL_P_IOC[TQ]SIZE, the
+ * default for pipes yet to be opened: "Tell" resizes it, keeping what
+ * it holds, and returns the new size (a power of two); "Query" returns
+ * it.
+ */
+#define SCULL_P_IOCTRING  _IO(SCULL_IOC_MAGIC,  28)
+#define SCULL_P_IOCQRING  _IO(SCULL_IOC_MAGIC,  29)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 29
    
 #endif /* _SCULL_H_ */
 
@@ -0,0 +1,206 @@
+/*
+ * scull_trace.h -- tracepoints for the scull char module
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ * Unlike PDEBUG, these cost next to nothing until they are enabled
+ * (through /sys/kernel/debug/tracing/events/scull, perf or the like).
+ * main.c defines CREATE_TRACE_POINTS before including this.
+ */
+
+#ifndef _SCULL_TRACE_CLOCK
+#define _SCULL_TRACE_CLOCK
+
+#include <linux/sched.h>        /* local_clock() */
+#include <linux/jump_label.h>
+
+/*
+ * Latencies are only measured while the event reporting them is
+ * enabled, so that a disabled tracepoint doesn't even read the clock.
+ * One enabled halfway through an operation reports 0.
+ */
+#define scull_trace_clock(event)					\
+   (static_key_false(&__tracepoint_##event.key) ? local_clock() : 0)
+#define scull_trace_since(start) ((start) ? local_clock() - (start) : 0)
+
+#endif /* _SCULL_TRACE_CLOCK */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/types.h>
+#include <linux/kdev_t.h>
+#include <linux/tracepoint.h>
+
+/*
+ * A read or write starts: on which device (bare or pipe), where, and
+ * how much was asked for.
+ */
+DECLARE_EVENT_CLASS(scull_io_start,
+   TP_PROTO(dev_t dev, loff_t offset, size_t count),
+   TP_ARGS(dev, offset, count),
+   TP_STRUCT__entry(
+      __field(dev_t, dev)
+      __field(loff_t, offset)
+      __field(size_t, count)
+   ),
+   TP_fast_assign(
+      __entry->dev = dev;
+      __entry->offset = offset;
+      __entry->count = count;
+   ),
+   TP_printk("dev=%d:%d offset=%lld count=%zu",
+	     MAJOR(__entry->dev), MINOR(__entry->dev),
+	     (long long) __entry->offset, __entry->count)
+);
+
+/*
+ * ... and ends: what it returned, and how long it took (ns).
+ */
+DECLARE_EVENT_CLASS(scull_io_end,
+   TP_PROTO(dev_t dev, loff_t offset, ssize_t retval, u64 latency),
+   TP_ARGS(dev, offset, retval, latency),
+   TP_STRUCT__entry(
+      __field(dev_t, dev)
+      __field(loff_t, offset)
+      __field(ssize_t, retval)
+      __field(u64, latency)
+   ),
+   TP_fast_assign(
+      __entry->dev = dev;
+      __entry->offset = offset;
+      __entry->retval = retval;
+      __entry->latency = latency;
+   ),
+   TP_printk("dev=%d:%d offset=%lld retval=%zd latency=%llu",
+	     MAJOR(__entry->dev), MINOR(__entry->dev),
+	     (long long) __entry->offset, __entry->retval,
+	     (unsigned long long) __entry->latency)
+);
+
+DEFINE_EVENT(scull_io_start, scull_read_start,
+   TP_PROTO(dev_t dev, loff_t offset, size_t count),
+   TP_ARGS(dev, offset, count));
+DEFINE_EVENT(scull_io_end, scull_read_end,
+   TP_PROTO(dev_t dev, loff_t offset, ssize_t retval, u64 latency),
+   TP_ARGS(dev, offset, retval, latency));
+DEFINE_EVENT(scull_io_start, scull_write_start,
+   TP_PROTO(dev_t dev, loff_t offset, size_t count),
+   TP_ARGS(dev, offset, count));
+DEFINE_EVENT(scull_io_end, scull_write_end,
+   TP_PROTO(dev_t dev, loff_t offset, ssize_t retval, u64 latency),
+   TP_ARGS(dev, offset, retval, latency));
+DEFINE_EVENT(scull_io_start, scull_p_read_start,
+   TP_PROTO(dev_t dev, loff_t offset, size_t count),
+   TP_ARGS(dev, offset, count));
+DEFINE_EVENT(scull_io_end, scull_p_read_end,
+   TP_PROTO(dev_t dev, loff_t offset, ssize_t retval, u64 latency),
+   TP_ARGS(dev, offset, retval, latency));
+DEFINE_EVENT(scull_io_start, scull_p_write_start,
+   TP_PROTO(dev_t dev, loff_t offset, size_t count),
+   TP_ARGS(dev, offset, count));
+DEFINE_EVENT(scull_io_end, scull_p_write_end,
+   TP_PROTO(dev_t dev, loff_t offset, ssize_t retval, u64 latency),
+   TP_ARGS(dev, offset, retval, latency));
+
+/*
+ * A trim: how much the device held, then how long emptying it took
+ * (freeing the memory happens later, see scull_retire_index).
+ */
+TRACE_EVENT(scull_trim_start,
+   TP_PROTO(dev_t dev, unsigned long size, long used),
+   TP_ARGS(dev, size, used),
+   TP_STRUCT__entry(
+      __field(dev_t, dev)
+      __field(unsigned long, size)
+      __field(long, used)
+   ),
+   TP_fast_assign(
+      __entry->dev = dev;
+      __entry->size = size;
+      __entry->used = used;
+   ),
+   TP_printk("dev=%d:%d size=%lu used=%ld",
+	     MAJOR(__entry->dev), MINOR(__entry->dev),
+	     __entry->size, __entry->used)
+);
+
+TRACE_EVENT(scull_trim_end,
+   TP_PROTO(dev_t dev, int retval, u64 latency),
+   TP_ARGS(dev, retval, latency),
+   TP_STRUCT__entry(
+      __field(dev_t, dev)
+      __field(int, retval)
+      __field(u64, latency)
+   ),
+   TP_fast_assign(
+      __entry->dev = dev;
+      __entry->retval = retval;
+      __entry->latency = latency;
+   ),
+   TP_printk("dev=%d:%d retval=%d latency=%llu",
+	     MAJOR(__entry->dev), MINOR(__entry->dev), __entry->retval,
+	     (unsigned long long) __entry->latency)
+);
+
+/*
+ * Time spent blocked (ns): on a device semaphore, and in the sleeps
+ * of the pipes, waiting for data (read) or for room (write).
+ */
+TRACE_EVENT(scull_sem_wait,
+   TP_PROTO(dev_t dev, u64 latency),
+   TP_ARGS(dev, latency),
+   TP_STRUCT__entry(
+      __field(dev_t, dev)
+      __field(u64, latency)
+   ),
+   TP_fast_assign(
+      __entry->dev = dev;
+      __entry->latency = latency;
+   ),
+   TP_printk("dev=%d:%d latency=%llu",
+	     MAJOR(__entry->dev), MINOR(__entry->dev),
+	     (unsigned long long) __entry->latency)
+);
+
+TRACE_EVENT(scull_p_sleep,
+   TP_PROTO(dev_t dev, int write, int retval, u64 latency),
+   TP_ARGS(dev, write, retval, latency),
+   TP_STRUCT__entry(
+      __field(dev_t, dev)
+      __field(int, write)
+      __field(int, retval)
+      __field(u64, latency)
+   ),
+   TP_fast_assign(
+      __entry->dev = dev;
+      __entry->write = write;
+      __entry->retval = retval;
+      __entry->latency = latency;
+   ),
+   TP_printk("dev=%d:%d %s retval=%d latency=%llu",
+	     MAJOR(__entry->dev), MINOR(__entry->dev),
+	     __entry->write ? "write" : "read", __entry->retval,
+	     (unsigned long long) __entry->latency)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+/* this part must be outside the protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
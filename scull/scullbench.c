@@ -0,0 +1,575 @@
+/* scullbench.c
+ * A small benchmark for the "/dev/scull" device (a.k.a "scull0").
+ *
+ *   scullbench randread [device] [reads]
+ *   scullbench writers  [device] [MB per writer]
+ *   scullbench batch    [device] [operations]
+ *   scullbench numa     [device] [MB]
+ *   scullbench stream   [pipe] [MB]
+ *   scullbench pingpong [pipe] [round trips]
+ *   scullbench burst    [pipe] [MB]
+ *   scullbench reopen   [pipe] [cycles]
+ *
+ * randread: fill the device to a range of sizes and time random
+ * one-byte reads over the whole of it. With the item index the
+ * latency should stay flat as the device grows.
+ *
+ * writers: 1, 2, 4 and 8 threads each fill a region of their own
+ * (so they never share a quantum set) and the total throughput is
+ * reported for each thread count.
+ *
+ * batch: small (64-byte) writes and reads, one system call each and
+ * then in batches of 64 through SCULL_IOCBATCH.
+ *
+ * numa: running on the CPUs of node 0, bind the device to each node
+ * in turn (SCULL_IOCSNODE, so as root) and time filling it and
+ * reading it back: local against remote memory. Interleaved last.
+ *
+ * stream: one thread writes to a scullpipe, another reads from it,
+ * 4 kB at a time. pingpong: two threads pass one byte back and forth
+ * through the pipe given and the next one (scullpipe0 and scullpipe1).
+ * Run them with scull_p_spsc=0 and then 1 to compare the two modes.
+ *
+ * burst: as stream, but the writer hands the pipe 1 MB at a time,
+ * with the ring resized (SCULL_P_IOCTRING) to 4 kB, 64 kB, 1 MB and
+ * 16 MB in turn. How many write calls a burst took tells how often
+ * the writer had to come back for more room.
+ *
+ * reopen: like a short-lived producer and consumer, open, write 64
+ * bytes and close, then open, read them back and close. Run it with
+ * scull_p_persist=0 and then 1: the messages lost, and what the
+ * allocation of the ring at each cycle costs.
+ *
+ * Build with "cc -O2 -o scullbench scullbench.c -lpthread".
+ */
+#define _GNU_SOURCE             /* sched_setaffinity() */
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/types.h>
+
+#define MB (1024L * 1024L)
+
+/* as in scull.h, which is not for user space */
+struct scull_cmd {
+   __u32 op;
+   __u32 reserved;
+   __s64 result;
+   __u64 offset;
+   __u64 addr;
+   __u64 len;
+};
+
+struct scull_batch {
+   __u64 cmds;
+   __u32 count;
+   __u32 done;
+};
+
+#define SCULL_CMD_READ  0
+#define SCULL_CMD_WRITE 1
+#define SCULL_IOCBATCH  _IOWR('k', 22, struct scull_batch)
+#define SCULL_NODE_INTERLEAVE (-2)
+#define SCULL_IOCSNODE  _IOW('k', 26, int)
+#define SCULL_P_IOCTRING _IO('k', 28)
+
+static double now_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* scull may return short writes, so loop until "size" bytes are in */
+static int fill(const char *dev, long size) {
+   static char buf[64 * 1024];
+   long done = 0;
+   int fd, result;
+
+   memset(buf, 'x', sizeof(buf));
+   if ((fd = open(dev, O_WRONLY)) == -1) { /* write-only open trims */
+      perror("open for fill failed");
+      return -1;
+   }
+   while (done < size) {
+      result = write(fd, buf, size - done < (long)sizeof(buf) ?
+		     size - done : (long)sizeof(buf));
+      if (result <= 0) {
+	 perror("fill write failed");
+	 close(fd);
+	 return -1;
+      }
+      done += result;
+   }
+   close(fd);
+   return 0;
+}
+
+static int randread(const char *dev, long reads) {
+   static const long sizes[] = { 1, 4, 16, 64, 256, 1024 };
+   unsigned int i;
+   long n;
+   double t;
+   char c;
+   int fd;
+
+   printf("%10s %12s\n", "size (MB)", "ns/read");
+   for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      long size = sizes[i] * MB;
+
+      if (fill(dev, size))
+	 return -1;
+      if ((fd = open(dev, O_RDONLY)) == -1) {
+	 perror("open for read failed");
+	 return -1;
+      }
+      srandom(1);
+      t = now_ns();
+      for (n = 0; n < reads; n++) {
+	 off_t off = ((off_t)random() * 4096 + random() % 4096) % size;
+	 if (pread(fd, &c, 1, off) != 1) {
+	    perror("pread failed");
+	    close(fd);
+	    return -1;
+	 }
+      }
+      t = now_ns() - t;
+      close(fd);
+      printf("%10li %12.1f\n", sizes[i], t / reads);
+   }
+   return 0;
+}
+
+struct writer {
+   pthread_t thread;
+   const char *dev;
+   off_t base;
+   long size;
+   int failed;
+};
+
+static void *writer(void *arg) {
+   char *buf = malloc(64 * 1024);
+   struct writer *w = arg;
+   long done = 0;
+   int fd, result;
+
+   if (!buf || (fd = open(w->dev, O_RDWR)) == -1) { /* no trim here */
+      perror("writer open failed");
+      w->failed = 1;
+      free(buf);
+      return NULL;
+   }
+   /* not zeros: scull would turn those back into holes */
+   memset(buf, 'x', 64 * 1024);
+   while (done < w->size) {
+      result = pwrite(fd, buf, 64 * 1024, w->base + done);
+      if (result <= 0) {
+	 perror("writer pwrite failed");
+	 w->failed = 1;
+	 break;
+      }
+      done += result;
+   }
+   close(fd);
+   free(buf);
+   return NULL;
+}
+
+static int writers(const char *dev, long mb) {
+   static const int counts[] = { 1, 2, 4, 8 };
+   struct writer w[8];
+   unsigned int i;
+   int n, failed = 0;
+   double t;
+
+   printf("%10s %12s\n", "writers", "MB/s");
+   for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+      if (fill(dev, 0)) /* start from an empty device */
+	 return -1;
+      t = now_ns();
+      for (n = 0; n < counts[i]; n++) {
+	 w[n].dev = dev;
+	 w[n].base = (off_t)n * mb * MB;
+	 w[n].size = mb * MB;
+	 w[n].failed = 0;
+	 pthread_create(&w[n].thread, NULL, writer, &w[n]);
+      }
+      for (n = 0; n < counts[i]; n++) {
+	 pthread_join(w[n].thread, NULL);
+	 failed |= w[n].failed;
+      }
+      t = now_ns() - t;
+      if (failed)
+	 return -1;
+      printf("%10i %12.1f\n", counts[i], counts[i] * mb * 1e9 / t);
+   }
+   return 0;
+}
+
+static int batch(const char *dev, long ops) {
+   static char buf[64 * 64];
+   struct scull_cmd cmds[64];
+   struct scull_batch b;
+   long n;
+   int i, fd;
+   double t;
+
+   if (fill(dev, 0)) /* start from an empty device */
+      return -1;
+   if ((fd = open(dev, O_RDWR)) == -1) {
+      perror("open failed");
+      return -1;
+   }
+   memset(buf, 'x', sizeof(buf)); /* zeros would only make holes */
+   printf("%10s %12s\n", "mode", "ns/op");
+
+   t = now_ns();
+   for (n = 0; n < ops; n++) {
+      if (pwrite(fd, buf, 64, (n % 4096) * 64) != 64 ||
+	  pread(fd, buf, 64, (n % 4096) * 64) != 64) {
+	 perror("single op failed");
+	 close(fd);
+	 return -1;
+      }
+   }
+   printf("%10s %12.1f\n", "single", (now_ns() - t) / (2 * ops));
+
+   t = now_ns();
+   for (n = 0; n < ops; n += 32) {
+      for (i = 0; i < 64; i++) {
+	 cmds[i].op = i & 1 ? SCULL_CMD_READ : SCULL_CMD_WRITE;
+	 cmds[i].offset = ((n + i / 2) % 4096) * 64;
+	 cmds[i].addr = (unsigned long)(buf + (i / 2) * 64);
+	 cmds[i].len = 64;
+      }
+      b.cmds = (unsigned long)cmds;
+      b.count = 64;
+      if (ioctl(fd, SCULL_IOCBATCH, &b) != 64) {
+	 perror("batch failed");
+	 close(fd);
+	 return -1;
+      }
+   }
+   printf("%10s %12.1f\n", "batch", (now_ns() - t) / (2 * ops));
+   close(fd);
+   return 0;
+}
+
+/* run on the CPUs of a node, as listed in sysfs ("0-7,16-23") */
+static int bind_node(int node) {
+   char path[64], list[256], *p = list;
+   cpu_set_t set;
+   int first, last;
+   FILE *f;
+
+   sprintf(path, "/sys/devices/system/node/node%i/cpulist", node);
+   if (!(f = fopen(path, "r")) || !fgets(list, sizeof(list), f)) {
+      perror(path);
+      if (f)
+	 fclose(f);
+      return -1;
+   }
+   fclose(f);
+   CPU_ZERO(&set);
+   while (sscanf(p, "%i", &first) == 1) {
+      last = first;
+      p += strspn(p, "0123456789");
+      if (*p == '-' && sscanf(++p, "%i", &last) == 1)
+	 p += strspn(p, "0123456789");
+      while (first <= last)
+	 CPU_SET(first++, &set);
+      if (*p++ != ',')
+	 break;
+   }
+   if (sched_setaffinity(0, sizeof(set), &set)) {
+      perror("sched_setaffinity failed");
+      return -1;
+   }
+   return 0;
+}
+
+static int numa_one(const char *dev, int node, long mb) {
+   static char buf[64 * 1024];
+   double tw, tr;
+   long done;
+   int fd;
+
+   if (fill(dev, 0)) /* empty, so that all of it is allocated anew */
+      return -1;
+   if ((fd = open(dev, O_RDWR)) == -1) {
+      perror("open failed");
+      return -1;
+   }
+   memset(buf, 'x', sizeof(buf)); /* zeros would only make holes */
+   if (ioctl(fd, SCULL_IOCSNODE, &node)) {
+      perror("SCULL_IOCSNODE failed");
+      close(fd);
+      return -1;
+   }
+   tw = now_ns();
+   for (done = 0; done < mb * MB; done += sizeof(buf))
+      if (pwrite(fd, buf, sizeof(buf), done) != sizeof(buf)) {
+	 perror("pwrite failed");
+	 close(fd);
+	 return -1;
+      }
+   tw = now_ns() - tw;
+   tr = now_ns();
+   for (done = 0; done < mb * MB; done += sizeof(buf))
+      if (pread(fd, buf, sizeof(buf), done) != sizeof(buf)) {
+	 perror("pread failed");
+	 close(fd);
+	 return -1;
+      }
+   tr = now_ns() - tr;
+   close(fd);
+
+   if (node == SCULL_NODE_INTERLEAVE)
+      printf("%10s %12.1f %12.1f\n", "interleave", mb * 1e9 / tw,
+	     mb * 1e9 / tr);
+   else
+      printf("%3i %-6s %12.1f %12.1f\n", node, node ? "remote" : "local",
+	     mb * 1e9 / tw, mb * 1e9 / tr);
+   return 0;
+}
+
+static int numa(const char *dev, long mb) {
+   char path[64];
+   int node;
+
+   if (bind_node(0))
+      return -1;
+   printf("%10s %12s %12s\n", "node", "write MB/s", "read MB/s");
+   for (node = 0; ; node++) {
+      sprintf(path, "/sys/devices/system/node/node%i", node);
+      if (access(path, F_OK))
+	 break;
+      if (numa_one(dev, node, mb))
+	 return -1;
+   }
+   return numa_one(dev, SCULL_NODE_INTERLEAVE, mb);
+}
+
+struct streamer {
+   int fd;
+   long size;
+   int reader;
+   int failed;
+   long chunk;                  /* bytes per call, at most */
+   long calls;                  /* system calls made */
+};
+
+static void *streamer(void *arg) {
+   struct streamer *st = arg;
+   char *buf = calloc(1, st->chunk);
+   long done = 0;
+   int result;
+
+   st->calls = 0;
+   while (buf && done < st->size) {
+      if (st->reader)
+	 result = read(st->fd, buf, st->chunk);
+      else
+	 result = write(st->fd, buf, st->chunk);
+      st->calls++;
+      if (result <= 0) {
+	 perror("pipe i/o failed");
+	 st->failed = 1;
+	 break;
+      }
+      done += result;
+   }
+   if (!buf)
+      st->failed = 1;
+   free(buf);
+   return NULL;
+}
+
+/*
+ * One reader and one writer through dev; the time it took, or a
+ * negative number. A ring size of 0 leaves the ring alone.
+ */
+static double stream_one(const char *dev, long mb, long wchunk, long ring,
+			 long *wcalls) {
+   struct streamer st[2] = {
+      { -1, mb * MB, 1, 0, 4096, 0 },
+      { -1, mb * MB, 0, 0, wchunk, 0 },
+   };
+   pthread_t th[2];
+   double t;
+   int i;
+
+   /* both open before anything is written: an open empties the pipe */
+   if ((st[0].fd = open(dev, O_RDONLY)) == -1 ||
+       (st[1].fd = open(dev, O_WRONLY)) == -1) {
+      perror("pipe open failed");
+      return -1;
+   }
+   if (ring && ioctl(st[1].fd, SCULL_P_IOCTRING, ring) < 0) {
+      perror("SCULL_P_IOCTRING failed");
+      close(st[0].fd);
+      close(st[1].fd);
+      return -1;
+   }
+   t = now_ns();
+   for (i = 0; i < 2; i++)
+      pthread_create(&th[i], NULL, streamer, &st[i]);
+   for (i = 0; i < 2; i++)
+      pthread_join(th[i], NULL);
+   t = now_ns() - t;
+   close(st[0].fd);
+   close(st[1].fd);
+   if (st[0].failed || st[1].failed)
+      return -1;
+   if (wcalls)
+      *wcalls = st[1].calls;
+   return t;
+}
+
+static int stream(const char *dev, long mb) {
+   double t = stream_one(dev, mb, 4096, 0, NULL);
+
+   if (t < 0)
+      return -1;
+   printf("%10s %12.1f\n", "MB/s", mb * 1e9 / t);
+   return 0;
+}
+
+static int burst(const char *dev, long mb) {
+   static const long rings[] = { 4096, 64 * 1024, MB, 16 * MB };
+   long wcalls;
+   double t;
+   unsigned int i;
+
+   printf("%10s %12s %12s\n", "ring", "MB/s", "writes/MB");
+   for (i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+      t = stream_one(dev, mb, MB, rings[i], &wcalls);
+      if (t < 0)
+	 return -1;
+      printf("%10ld %12.1f %12.1f\n", rings[i], mb * 1e9 / t,
+	     (double) wcalls / mb);
+   }
+   return 0;
+}
+
+struct ponger {
+   int in, out;
+   long trips;
+};
+
+static void *ponger(void *arg) {
+   struct ponger *p = arg;
+   long n;
+   char c;
+
+   for (n = 0; n < p->trips; n++)
+      if (read(p->in, &c, 1) != 1 || write(p->out, &c, 1) != 1)
+	 break;
+   return NULL;
+}
+
+static int pingpong(const char *dev, long trips) {
+   char other[64];
+   struct ponger p;
+   pthread_t th;
+   size_t len = strlen(dev);
+   long n;
+   double t;
+   char c = 'x';
+   int ping, pong;
+
+   if (len == 0 || len >= sizeof(other)) {
+      fprintf(stderr, "bad device name\n");
+      return -1;
+   }
+   strcpy(other, dev);
+   other[len - 1]++; /* scullpipe0 -> scullpipe1 */
+   if ((ping = open(dev, O_RDWR)) == -1 || (pong = open(other, O_RDWR)) == -1) {
+      perror("pipe open failed");
+      return -1;
+   }
+   p.in = ping;
+   p.out = pong;
+   p.trips = trips;
+   pthread_create(&th, NULL, ponger, &p);
+   t = now_ns();
+   for (n = 0; n < trips; n++)
+      if (write(ping, &c, 1) != 1 || read(pong, &c, 1) != 1) {
+	 perror("ping failed");
+	 break;
+      }
+   t = now_ns() - t;
+   pthread_join(th, NULL);
+   close(ping);
+   close(pong);
+   if (n < trips)
+      return -1;
+   printf("%10s %12.1f\n", "ns/trip", t / trips);
+   return 0;
+}
+
+static int reopen(const char *dev, long cycles) {
+   char buf[64];
+   long n, lost = 0;
+   double t;
+   int fd;
+
+   memset(buf, 'x', sizeof(buf));
+   t = now_ns();
+   for (n = 0; n < cycles; n++) {
+      if ((fd = open(dev, O_WRONLY)) == -1)
+	 break;
+      if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+	 break;
+      close(fd);
+      /* not to wait for data a non-persistent pipe has thrown away */
+      if ((fd = open(dev, O_RDONLY | O_NONBLOCK)) == -1)
+	 break;
+      if (read(fd, buf, sizeof(buf)) != sizeof(buf))
+	 lost++;
+      close(fd);
+   }
+   t = now_ns() - t;
+   if (n < cycles) {
+      perror("pipe i/o failed");
+      return -1;
+   }
+   printf("%10s %12s\n", "ns/cycle", "lost");
+   printf("%10.1f %12ld\n", t / cycles, lost);
+   return 0;
+}
+
+int main(int argc, char **argv) {
+   const char *test = argc > 1 ? argv[1] : "randread";
+   const char *dev = argc > 2 ? argv[2] : "/dev/scull";
+
+   if (!strcmp(test, "randread"))
+      return randread(dev, argc > 3 ? atol(argv[3]) : 100000) ? 1 : 0;
+   if (!strcmp(test, "writers"))
+      return writers(dev, argc > 3 ? atol(argv[3]) : 64) ? 1 : 0;
+   if (!strcmp(test, "batch"))
+      return batch(dev, argc > 3 ? atol(argv[3]) : 1000000) ? 1 : 0;
+   if (!strcmp(test, "numa"))
+      return numa(dev, argc > 3 ? atol(argv[3]) : 256) ? 1 : 0;
+   if (!strcmp(test, "stream"))
+      return stream(argc > 2 ? dev : "/dev/scullpipe0",
+		    argc > 3 ? atol(argv[3]) : 1024) ? 1 : 0;
+   if (!strcmp(test, "pingpong"))
+      return pingpong(argc > 2 ? dev : "/dev/scullpipe0",
+		      argc > 3 ? atol(argv[3]) : 100000) ? 1 : 0;
+   if (!strcmp(test, "burst"))
+      return burst(argc > 2 ? dev : "/dev/scullpipe0",
+		   argc > 3 ? atol(argv[3]) : 256) ? 1 : 0;
+   if (!strcmp(test, "reopen"))
+      return reopen(argc > 2 ? dev : "/dev/scullpipe0",
+		    argc > 3 ? atol(argv[3]) : 100000) ? 1 : 0;
+   fprintf(stderr, "usage: %s randread|writers|batch|numa|stream|pingpong"
+	   "|burst|reopen [device] [count]\n", argv[0]);
+   return 1;
+}
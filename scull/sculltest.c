@@ -8,10 +8,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 int main() {
    int fd, result, len;
-   char buf[10];
+   char buf[10], *map;
    const char *str;
    if ((fd = open("/dev/scull", O_WRONLY)) == -1) {
       perror("1. open failed");
@@ -41,6 +42,24 @@ int main() {
       fprintf (stdout, "passed\n");
    }
    close(fd);
+
+   /* the same bytes, through a mapping */
+   if ((fd = open("/dev/scull", O_RDONLY)) == -1) {
+      perror("2. open failed");
+      return -1;
+   }
+   map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      perror("2. mmap failed");
+      return -1;
+   }
+   if (strncmp (map, str, len)) {
+      fprintf (stdout, "failed: mapped \"%.*s\"\n", len, map);
+   } else {
+      fprintf (stdout, "passed\n");
+   }
+   munmap(map, len);
+   close(fd);
    
    
    str = "xyz"; len = strlen(str);
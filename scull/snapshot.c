@@ -0,0 +1,197 @@
+/*
+ * snapshot.c -- read-only, copy-on-write snapshots of scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>       /* printk() */
+#include <linux/fs.h>
+#include <linux/errno.h>        /* error codes */
+#include <linux/cdev.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/radix-tree.h>
+#include <linux/splice.h>
+#include <asm/atomic.h>
+
+#include "scull.h"              /* local definitions */
+
+/*
+ * A snapshot lives in one of the scullsnap devices: a scull device
+ * like the others, but one that can't be opened for writing. Taking
+ * it shares the arrays of the source (see scull_share_index), so the
+ * cost is in the items, not in the arrays or the data.
+ */
+struct scull_snap {
+   struct scull_dev dev;
+   int taken;                /* holds a snapshot */
+   int opens;                /* how many times it's open */
+};
+
+static struct scull_snap scull_snaps[SCULL_N_SNAPS];
+static DEFINE_MUTEX(scull_snap_mutex);  /* protects taken and opens */
+static dev_t scull_snap_firstdev;
+static int scull_snap_registered;
+
+static int scull_snap_open(struct inode *inode, struct file *filp) {
+   struct scull_snap *snap = container_of(inode->i_cdev, struct scull_snap,
+					  dev.cdev);
+   int retval = 0;
+
+   if (filp->f_mode & FMODE_WRITE)
+      return -EROFS;
+   mutex_lock(&scull_snap_mutex);
+   if (snap->taken)
+      snap->opens++;
+   else
+      retval = -ENXIO; /* nothing there yet */
+   mutex_unlock(&scull_snap_mutex);
+   filp->private_data = &snap->dev;
+   return retval;
+}
+
+static int scull_snap_release(struct inode *inode, struct file *filp) {
+   struct scull_snap *snap = container_of(inode->i_cdev, struct scull_snap,
+					  dev.cdev);
+
+   mutex_lock(&scull_snap_mutex);
+   snap->opens--;
+   mutex_unlock(&scull_snap_mutex);
+   return 0;
+}
+
+/*
+ * Only the read side of the bare device operations.
+ */
+struct file_operations scull_snap_fops = {
+   .owner =        THIS_MODULE,
+   .llseek =       scull_llseek,
+   .read =         scull_read,
+   .aio_read =     scull_aio_read,
+   .splice_read =  scull_splice_read,
+   .unlocked_ioctl = scull_ioctl,
+   .open =         scull_snap_open,
+   .release =      scull_snap_release,
+};
+
+/*
+ * Take a snapshot of dev into the first free scullsnap device, and
+ * return its number. Writers to dev wait meanwhile; readers don't.
+ */
+int scull_snapshot(struct scull_dev *dev) {
+   struct scull_snap *snap = NULL;
+   int i, retval;
+
+   mutex_lock(&scull_snap_mutex);
+   for (i = 0; i < SCULL_N_SNAPS && scull_snap_registered; i++)
+      if (!scull_snaps[i].taken && !scull_snaps[i].opens) {
+	 snap = scull_snaps + i;
+	 break;
+      }
+   if (!snap) {
+      mutex_unlock(&scull_snap_mutex);
+      return -ENOSPC;
+   }
+
+   down_write(&dev->sem);
+   if (atomic_read(&dev->vmas)) { /* stores through a mapping aren't seen */
+      retval = -EBUSY;
+   } else {
+      snap->dev.quantum = dev->quantum;
+      snap->dev.qset = dev->qset;
+      snap->dev.node = dev->node; /* its items go along with the data */
+      retval = scull_share_index(dev, &snap->dev);
+   }
+   up_write(&dev->sem);
+
+   if (retval) { /* undo whatever was shared already */
+      down_write(&snap->dev.sem);
+      scull_trim(&snap->dev);
+      up_write(&snap->dev.sem);
+   } else {
+      snap->taken = 1;
+      retval = i;
+   }
+   mutex_unlock(&scull_snap_mutex);
+   return retval;
+}
+
+/*
+ * Drop snapshot n, which gives back whatever it alone still holds.
+ */
+int scull_snap_drop(int n) {
+   struct scull_snap *snap;
+   int retval = 0;
+
+   if (n < 0 || n >= SCULL_N_SNAPS || !scull_snap_registered)
+      return -EINVAL;
+   snap = scull_snaps + n;
+   mutex_lock(&scull_snap_mutex);
+   if (snap->opens) {
+      retval = -EBUSY;
+   } else if (snap->taken) {
+      down_write(&snap->dev.sem);
+      scull_trim(&snap->dev);
+      up_write(&snap->dev.sem);
+      snap->taken = 0;
+   }
+   mutex_unlock(&scull_snap_mutex);
+   return retval;
+}
+
+/*
+ * Set up the scullsnap devices; like scull_access_init, return how
+ * many device numbers were used.
+ */
+int scull_snap_init(dev_t firstdev) {
+   struct scull_dev *dev;
+   int i, err;
+
+   if (register_chrdev_region(firstdev, SCULL_N_SNAPS, "scullsnap") < 0) {
+      printk(KERN_WARNING "scullsnap: device number registration failed\n");
+      return 0;
+   }
+   scull_snap_firstdev = firstdev;
+   scull_snap_registered = 1;
+
+   for (i = 0; i < SCULL_N_SNAPS; i++) {
+      dev = &scull_snaps[i].dev;
+      scull_init_dev(dev);
+      dev->own_geometry = 1; /* whatever the source had */
+      dev->limit = 0;
+      cdev_init(&dev->cdev, &scull_snap_fops);
+      dev->cdev.owner = THIS_MODULE;
+      err = cdev_add(&dev->cdev, firstdev + i, 1);
+      if (err)
+	 printk(KERN_NOTICE "Error %d adding scullsnap%d\n", err, i);
+   }
+   return SCULL_N_SNAPS;
+}
+
+/*
+ * Called by cleanup_module or on failure; never fails.
+ */
+void scull_snap_cleanup(void) {
+   int i;
+
+   if (!scull_snap_registered)
+      return;
+   for (i = 0; i < SCULL_N_SNAPS; i++) {
+      cdev_del(&scull_snaps[i].dev.cdev);
+      scull_trim(&scull_snaps[i].dev);
+   }
+   scull_flush_work(); /* before the devices go away */
+   unregister_chrdev_region(scull_snap_firstdev, SCULL_N_SNAPS);
+   scull_snap_registered = 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * stats.c -- counters and memory statistics, in debugfs
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>       /* printk() */
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/percpu.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/seqlock.h>
+#include <linux/radix-tree.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched.h>        /* cond_resched() */
+#include <asm/atomic.h>
+
+#include "scull.h"              /* local definitions */
+
+/*
+ * Each bare device has a file in the scull debugfs directory, named
+ * after it. The counters are summed over the CPUs as they are, and
+ * the index is walked like a reader does: neither takes any lock a
+ * reader or writer of the device could be waiting for. A trim or a
+ * relayout running meanwhile starts the walk over, as it does a read.
+ */
+static void scull_stats_counters(struct seq_file *s, struct scull_dev *dev) {
+   struct scull_stats sum, *st;
+   int cpu;
+
+   memset(&sum, 0, sizeof(sum));
+   if (dev->stats)
+      for_each_possible_cpu(cpu) {
+	 st = per_cpu_ptr(dev->stats, cpu);
+	 sum.reads += st->reads;
+	 sum.writes += st->writes;
+	 sum.rbytes += st->rbytes;
+	 sum.wbytes += st->wbytes;
+	 sum.trims += st->trims;
+	 sum.nomem += st->nomem;
+	 sum.semwait += st->semwait;
+      }
+   seq_printf(s, "reads:     %lu\n", sum.reads);
+   seq_printf(s, "rbytes:    %lu\n", sum.rbytes);
+   seq_printf(s, "writes:    %lu\n", sum.writes);
+   seq_printf(s, "wbytes:    %lu\n", sum.wbytes);
+   seq_printf(s, "trims:     %lu\n", sum.trims);
+   seq_printf(s, "nomem:     %lu\n", sum.nomem);
+   seq_printf(s, "semwait:   %llu ns\n", (unsigned long long) sum.semwait);
+}
+
+static void scull_stats_memory(struct seq_file *s, struct scull_dev *dev) {
+   struct scull_qset *dptr;
+   unsigned long item, size, slots;
+   unsigned long items, arrays, quanta, inside, zquanta, squanta;
+   int quantum, qset, s_pos, found, idx;
+   unsigned seq;
+   void **data;
+   void *q;
+
+   idx = srcu_read_lock(&scull_srcu);
+ retry:
+   seq = read_seqcount_begin(&dev->seq);
+   quantum = dev->quantum;
+   qset = dev->qset;
+   size = dev->size;
+   item = items = arrays = quanta = inside = zquanta = squanta = 0;
+
+   for (;;) {
+      rcu_read_lock();
+      found = radix_tree_gang_lookup(&dev->index, (void **) &dptr, item, 1);
+      rcu_read_unlock();
+      /* as in scull_do_read: only an item of our geometry is walked */
+      if (read_seqcount_retry(&dev->seq, seq))
+	 goto retry;
+      if (!found)
+	 break;
+      item = dptr->item + 1;
+      items++;
+      data = srcu_dereference(dptr->data, &scull_srcu);
+      if (!data)
+	 continue;
+      arrays++;
+      for (s_pos = 0; s_pos < qset; s_pos++) {
+	 q = srcu_dereference(data[s_pos], &scull_srcu);
+	 if (!q)
+	    continue;
+	 quanta++;
+	 if (SCULL_ZQUANTUM(q))
+	    zquanta++;
+	 else if (SCULL_SQUANTUM(q))
+	    squanta++;
+	 if (((long)dptr->item * qset + s_pos) * quantum < size)
+	    inside++;
+      }
+      cond_resched(); /* SRCU lets us */
+   }
+   srcu_read_unlock(&scull_srcu, idx);
+
+   slots = size / quantum + (size % quantum ? 1 : 0);
+   seq_printf(s, "size:      %lu\n", size);
+   seq_printf(s, "quantum:   %i\n", quantum);
+   seq_printf(s, "qset:      %i\n", qset);
+   seq_printf(s, "quanta:    %lu\n", quanta);
+   seq_printf(s, "zquanta:   %lu\n", zquanta);
+   seq_printf(s, "squanta:   %lu\n", squanta);
+   seq_printf(s, "used:      %li\n", atomic_long_read(&dev->used));
+   seq_printf(s, "holes:     %lu\n", slots > inside ? slots - inside : 0);
+   seq_printf(s, "items:     %lu\n", items);
+   seq_printf(s, "metadata:  %lu\n", items * sizeof(struct scull_qset) +
+	      arrays * qset * sizeof(void *));
+}
+
+static int scull_stats_show(struct seq_file *s, void *v) {
+   struct scull_dev *dev = s->private;
+
+   scull_stats_counters(s, dev);
+   scull_stats_memory(s, dev);
+   return 0;
+}
+
+static int scull_stats_open(struct inode *inode, struct file *file) {
+   return single_open(file, scull_stats_show, inode->i_private);
+}
+
+static struct file_operations scull_stats_fops = {
+   .owner =   THIS_MODULE,
+   .open =    scull_stats_open,
+   .read =    seq_read,
+   .llseek =  seq_lseek,
+   .release = single_release,
+};
+
+/*
+ * Called once the devices exist; the files go away with the rest of
+ * the directory.
+ */
+void scull_stats_init(void) {
+   char name[16];
+   int i;
+
+   for (i = 0; i < scull_nr_devs; i++) {
+      sprintf(name, "scull%i", i);
+      debugfs_create_file(name, S_IRUGO, scull_debugfs, scull_devices + i,
+			  &scull_stats_fops);
+   }
+}